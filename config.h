@@ -7,5 +7,29 @@
 #define TAB_WIDTH 4
 #define MAX_FILENAME 256
 #define BUFFER_SIZE 65536
+#define ESC_TIMEOUT_MS 50       // wait for the rest of an escape sequence
+#define PASTE_TIMEOUT_MS 1000  // give up on a paste that never ends
+#define MESSAGE_TIMEOUT_MS 5000 // status messages clear after this long
+#define SAVE_PROGRESS_MS 250   // status bar update interval while saving
+#define ROW_BLOCK_SIZE 1024     // rows per block in the row table
+#define ARENA_SLAB_SIZE (1u << 20) // bytes per row-text slab
+#define INDEX_CHECKPOINT_LINES 65536 // lines per background index checkpoint
+#define INDEX_PARALLEL_MIN (64u << 20) // files this big are indexed on several threads
+#define INDEX_THREADS 32        // upper bound on indexing threads
+#define SEARCH_PARALLEL_MIN (1u << 20) // buffers this big are searched on several threads
+#define SEARCH_THREADS 32       // upper bound on search threads
+#define SEARCH_CHUNK (4u << 20) // unindexed text is searched in pieces this big
+#define SEARCH_POLL (1u << 20)  // a search checks for cancellation this often (bytes)
+#define REGEX_DFA_STATES 1024   // cached DFA states per search thread
+#define UNDO_BYTES (4u << 20)   // size of the undo ring
+#define JOURNAL_IDLE_MS 1000    // write journaled edits after this much idle time
+#define JOURNAL_FSYNC_MS 5000   // fsync the journal at most this often
+#define JOURNAL_BATCH (256u << 10) // write the journal right away past this many bytes
+#define HL_SYNC_ROWS 2000       // rows tokenized on the spot to draw the screen
+#define HL_SLICE_ROWS 20000     // rows tokenized per background slice
+#define HL_IDLE_MS 50           // delay before background tokenizing starts
+#ifndef NED_STATS               // make CPPFLAGS=-DNED_STATS=1 overrides it
+#define NED_STATS 0             // 1 builds in Ctrl-T / --stats instrumentation
+#endif
 
 #endif
@@ -17,39 +17,180 @@
 #include <errno.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "config.h"
 #ifndef MAX_FILENAME
 #define MAX_FILENAME 256
 #endif
+#ifndef NED_STATS
+#define NED_STATS 0
+#endif
 
 #define SCREEN_ROWS 24
 #define SCREEN_COLS 80
 
 /* ---------- Types ---------- */
+// A row with capacity == 0 but non-NULL chars borrows its bytes from the
+// file mapping (E.buf->map) or an arena slab; it gets its own copy on the
+// first edit.
+// Owned rows are gap buffers and not NUL-terminated either.
 typedef struct {
     char *chars;
     size_t length;
     size_t capacity;
+    size_t gap;             // start of the gap in owned rows (see row_gap_move)
+    unsigned long stamp;    // change_count of the last edit (owned rows only)
 } editor_row;
 
-struct editor_config {
-    struct termios orig_termios;
-    int screen_rows;
-    int screen_cols;
+// Rows are stored in blocks of at most ROW_BLOCK_SIZE; inserting or
+// deleting a line only shifts the rows of its own block. A block that
+// has not been edited yet is just a span of the mapping holding num_rows
+// lines: once it is looked at it gets a table of 32-bit line offsets,
+// and real rows are only built when one of them is changed.
+typedef struct {
+    editor_row *rows;
+    int num_rows;
+    int capacity;
+    const char *span;       // unmaterialized block text, newlines included
+    size_t span_len;
+    uint32_t *offs;         // line starts within span (num_rows + 1), or NULL
+    uint8_t *hl;            // lexer state at the end of each row, or NULL
+} row_block;
+
+// Where the highlighting lexer is at the end of a row (see Highlighting)
+enum hl_state { HL_CODE, HL_BLOCK_COMMENT, HL_UNKNOWN = 255 };
+
+/* Undo log of one buffer (see the Undo section) */
+struct undo_log {
+    char *ring;
+    size_t head, cur, tail;
+    bool applying;              // replaying a record; don't log the edits
+};
+
+/* Journal of one buffer (see the Journal section) */
+struct journal_head {
+    char magic[8];
+    uint64_t ino, size;         // the file the records apply to
+    int64_t mtime_sec, mtime_nsec;
+};
+
+struct journal_log {
+    int fd;                     // the journal file, or -1 until the first edit
+    char path[PATH_MAX];
+    struct journal_head base;   // identity of the file on disk
+    bool off;                   // no journal for this buffer
+    bool replaying;
+    char *buf;                  // records not written yet
+    size_t len, cap;
+    size_t size;                // bytes in the journal file
+    bool unsynced;              // written since the last fsync
+    long long synced;           // now_ms() of the last fsync
+};
+
+// One open file with its own rows, view and history. E.buf is the one on
+// screen and everything that works on "the buffer" goes through it;
+// background work for another buffer (indexing, saving, streaming,
+// following) points E.buf at that buffer while it runs.
+struct editor_buffer {
     int cursor_x;
     int cursor_y;
     int row_offset;
     int col_offset;
+    bool wrap;              // soft wrap long rows instead of scrolling sideways
+    size_t wrap_offset;     // first shown screen line of row_offset when wrapping
     int num_rows;
-    editor_row *rows;
+    row_block *blocks;
+    int num_blocks;
+    int block_capacity;
+    int *block_index;       // Fenwick tree over blocks[].num_rows (1-based)
+    bool block_index_stale; // rebuild before the next lookup
+    int cache_block;        // last block looked up, for sequential access
+    int cache_start;        // first line of cache_block
+    char *map;              // read-only mapping of the opened file, or NULL
+    size_t map_size;
+    bool crlf;              // the file uses \r\n, so saved lines get it too
+    struct line_index *index;   // background indexer still running, or NULL
+    const struct syntax *syntax;    // highlighting rules, or NULL
+    int hl_from;            // rows before this one end in a known state
+    int *marks;             // bookmarked rows, ascending (Ctrl-B)
+    int num_marks;
+    int marks_cap;
     char filename[MAX_FILENAME];
     bool modified;
+    bool read_only;         // follow mode (-R): shown, never edited
+    bool changed_on_disk;   // the mapped file was cut short under us
+    unsigned long change_count; // bumped by every edit (see mark_modified)
+    struct undo_log undo;
+    struct journal_log journal;
+};
+
+struct editor_config {
+    struct termios orig_termios;
+    int screen_rows;
+    int screen_cols;
+    int render_x;           // where the cursor is on screen (see editor_scroll)
+    int render_y;
+    struct editor_buffer *buf;      // the buffer on screen
+    struct editor_buffer **buffers; // all open buffers, in opening order
+    int num_buffers;
     char status_msg[80];
 };
 
 static struct editor_config E;
 
+#if NED_STATS
+// Hot-path counters for Ctrl-T and --stats (see the Stats section)
+static struct {
+    unsigned long long frames, frame_ns, frame_max_ns;
+    unsigned long long out_bytes;   // written to the terminal
+    unsigned long long syscalls;    // poll/read/write of the main loop
+    unsigned long long allocs;      // row storage and frame buffers
+    unsigned long long keys;
+    size_t arena_bytes;             // arena slabs
+    size_t chunk_bytes;             // row text malloc'ed past the arena
+    bool show;                      // overlay in the message bar
+} stats;
+#define STAT_ADD(field, n) (stats.field += (n))
+#define STAT_SUB(field, n) (stats.field -= (n))
+#else
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_SUB(field, n) ((void)0)
+#endif
+
+enum editor_key {
+    ARROW_LEFT = 1000,
+    ARROW_RIGHT,
+    ARROW_UP,
+    ARROW_DOWN,
+    PASTE_START,
+    HOME_KEY,
+    END_KEY,
+    PAGE_UP,
+    PAGE_DOWN,
+};
+
+// Undo log records (see the Undo section)
+enum { UNDO_INSERT, UNDO_DELETE };
+enum {
+    UNDO_CONT = 1,          // part of the same step as the record before it
+    UNDO_TYPING = 2,        // typed characters; later ones extend the run
+    UNDO_BACKSPACE = 4,     // backspaced characters, stored last one first
+};
+
 /* ---------- Prototypes ---------- */
 static void die(const char *s);
 static void disable_raw_mode(void);
@@ -59,29 +200,44 @@ static void refresh_screen(void);
 static void set_status_message(const char *fmt, ...);
 static void save_file(void);
 static void open_file(const char *path);
+static void follow_check(void);
+static void hl_select(void);
 static void init_editor(void);
 static void process_keypress(void);
+static void editor_process_key(int k);
+static void undo_record(int type, int flags, int y, size_t x, const char *s, size_t n);
+static void undo_record_paste(int flags, int y, size_t x, const char *s, size_t n);
+static void journal_record(int type, int y, size_t x, const char *s, size_t n);
+static void journal_open(void);
+static size_t journal_mark(void);
+static void journal_saved(size_t mark);
+static void journal_hangup(void);
+static void bus_maps_check(void);
+static void bus_init(void);
 
 /* ---------- Terminal ---------- */
 
 static void wrlit(const char *s, size_t n) {
     while (n) {
         ssize_t w = write(STDOUT_FILENO, s, n);
+        STAT_ADD(syscalls, 1);
         if (w < 0) { if (errno == EINTR) continue; break; }
+        STAT_ADD(out_bytes, (size_t)w);
         s += (size_t)w; n -= (size_t)w;
     }
 }
 
 static void die(const char *s) {
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
-    wrlit("\x1b[?25h\x1b[0m\x1b[?1049l", 18); // show cursor, reset attrs, leave alt screen
+    // show cursor, reset attrs, no bracketed paste, leave alt screen
+    wrlit("\x1b[?25h\x1b[0m\x1b[?2004l\x1b[?1049l", 26);
     perror(s);
     exit(1);
 }
 
 static void disable_raw_mode(void) {
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
-    wrlit("\x1b[?25h\x1b[0m\x1b[?1049l", 18);
+    wrlit("\x1b[?25h\x1b[0m\x1b[?2004l\x1b[?1049l", 26);
 }
 
 static int get_window_size(int *rows, int *cols) {
@@ -100,382 +256,5396 @@ static void enable_raw_mode(void) {
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    // non-blocking reads: the event loop poll()s before reading
     raw.c_cc[VMIN]  = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 
-    // Enter alt screen, clear, home, hide cursor
-    wrlit("\x1b[?1049h\x1b[2J\x1b[H\x1b[?25l", 18);
+    // Enter alt screen, clear, home, hide cursor, bracketed paste on
+    wrlit("\x1b[?1049h\x1b[2J\x1b[H\x1b[?25l\x1b[?2004h", 26);
 }
 
-/* ---------- Row ops ---------- */
+/* ---------- Event loop ---------- */
+// main() blocks in poll() on the terminal, a self-pipe written by the
+// SIGWINCH handler, descriptors registered by subsystems and timers, and
+// only redraws after something actually changed.
 
-static void editor_update_row(editor_row *row, const char *s, size_t len) {
-    if (row->capacity < len + 1) {
-        size_t new_cap = len + 1;
-        char *p = realloc(row->chars, new_cap);
-        if (!p) die("realloc");
-        row->chars = p; row->capacity = new_cap;
-    }
-    memcpy(row->chars, s, len);
-    row->chars[len] = '\0';
-    row->length = len;
+#define MAX_WATCHES 16
+#define RESERVED_WATCHES 4  // kept free for the save, search, stream and follow pipes
+#define MAX_TIMERS 8
+
+struct fd_watch { int fd; void (*on_ready)(int fd); };
+struct timer { long long due; int interval; void (*fn)(void); };  // ms; fn NULL = free
+
+static struct fd_watch watches[MAX_WATCHES];
+static int num_watches;
+static struct timer timers[MAX_TIMERS];
+static bool ned_redraw = true;
+static int winch_pipe[2] = {-1, -1};
+
+static void request_redraw(void) { ned_redraw = true; }
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static void editor_free_row(editor_row *row) {
-    free(row->chars);
-    row->chars = NULL;
-    row->length = row->capacity = 0;
+static void event_watch_fd(int fd, void (*on_ready)(int fd)) {
+    if (num_watches == MAX_WATCHES) die("event_watch_fd");
+    watches[num_watches].fd = fd;
+    watches[num_watches].on_ready = on_ready;
+    num_watches++;
 }
 
-static void editor_delete_row(int at) {
-    if (at < 0 || at >= E.num_rows) return;
-    editor_free_row(&E.rows[at]);
-    memmove(&E.rows[at], &E.rows[at + 1], sizeof(editor_row) * (E.num_rows - at - 1));
-    E.num_rows--;
-    if (E.cursor_y >= E.num_rows) E.cursor_y = E.num_rows ? (E.num_rows - 1) : 0;
-    if (E.num_rows) {
-        int rowlen = (int)E.rows[E.cursor_y].length;
-        if (E.cursor_x > rowlen) E.cursor_x = rowlen;
-    } else {
-        E.cursor_x = 0;
+static void event_unwatch_fd(int fd) {
+    for (int i = 0; i < num_watches; i++) {
+        if (watches[i].fd != fd) continue;
+        watches[i] = watches[--num_watches];
+        return;
     }
-    E.modified = true;
 }
 
-static void editor_insert_row(int at, const char *s, size_t len) {
-    if (at < 0 || at > E.num_rows) return;
-    editor_row *nr = realloc(E.rows, sizeof(editor_row) * (E.num_rows + 1));
-    if (!nr) die("realloc");
-    E.rows = nr;
-    memmove(&E.rows[at + 1], &E.rows[at], sizeof(editor_row) * (E.num_rows - at));
-    E.rows[at].chars = NULL;
-    E.rows[at].capacity = 0;
-    E.rows[at].length = 0;
-    editor_update_row(&E.rows[at], s, len);
-    E.num_rows++;
-    E.modified = true;
+// Run fn after ms milliseconds, then every interval ms (0 = once). Returns
+// a handle for timer_stop().
+static int timer_start(int ms, int interval, void (*fn)(void)) {
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (timers[i].fn) continue;
+        timers[i].due = now_ms() + ms;
+        timers[i].interval = interval;
+        timers[i].fn = fn;
+        return i;
+    }
+    die("timer_start");
+    return -1;
 }
 
-static void editor_row_insert_char(editor_row *row, int at, int c) {
-    if (at < 0 || at > (int)row->length) at = (int)row->length;
-    if (row->capacity < row->length + 2) {
-        size_t new_cap = (row->length + 2) * 2;
-        char *p = realloc(row->chars, new_cap);
-        if (!p) die("realloc");
-        row->chars = p; row->capacity = new_cap;
+static void timer_stop(int id) {
+    if (id >= 0 && id < MAX_TIMERS) timers[id].fn = NULL;
+}
+
+/* ---------- Resize Handling ---------- */
+static volatile sig_atomic_t ned_need_resize = 0;
+static void on_winch(int sig) {
+    if (sig == SIGWINCH) ned_need_resize = 1;
+    int saved = errno;
+    if (write(winch_pipe[1], "w", 1) < 0) { /* pipe full: a wakeup is already pending */ }
+    errno = saved;
+}
+
+// SIGHUP/SIGTERM (a dropped session): get the journal onto disk, then go.
+static volatile sig_atomic_t ned_hangup = 0;
+static volatile sig_atomic_t ned_map_shrunk = 0;   // set by on_bus, see file maps
+static void on_hangup(int sig) {
+    ned_hangup = 1;
+    on_winch(sig);
+}
+
+static void on_winch_pipe(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+    if (ned_hangup) journal_hangup();
+    if (ned_map_shrunk) bus_maps_check();
+    if (ned_need_resize) {
+        ned_need_resize = 0;
+        get_window_size(&E.screen_rows, &E.screen_cols);
+        request_redraw();
     }
-    memmove(&row->chars[at + 1], &row->chars[at], row->length - (size_t)at + 1);
-    row->chars[at] = (char)c;
-    row->length++;
-    E.modified = true;
 }
 
-static void editor_row_delete_char(editor_row *row, int at) {
-    if (at < 0 || at >= (int)row->length) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->length - (size_t)at);
-    row->length--;
-    E.modified = true;
+static void event_init(void) {
+    if (pipe(winch_pipe) == -1) die("pipe");
+    for (int i = 0; i < 2; i++) {
+        fcntl(winch_pipe[i], F_SETFL, fcntl(winch_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(winch_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    event_watch_fd(winch_pipe[0], on_winch_pipe);
+    signal(SIGWINCH, on_winch);
+    signal(SIGHUP, on_hangup);
+    signal(SIGTERM, on_hangup);
+    bus_init();
 }
 
-static void editor_row_append_string(editor_row *row, const char *s, size_t len) {
-    size_t new_len = row->length + len;
-    if (row->capacity < new_len + 1) {
-        size_t new_cap = new_len + 1;
-        char *p = realloc(row->chars, new_cap);
-        if (!p) die("realloc");
-        row->chars = p; row->capacity = new_cap;
+// Wait for the next batch of events and dispatch them.
+static void event_wait(void) {
+    struct pollfd pfd[MAX_WATCHES + 1];
+    pfd[0].fd = STDIN_FILENO;
+    pfd[0].events = POLLIN;
+    for (int i = 0; i < num_watches; i++) {
+        pfd[i + 1].fd = watches[i].fd;
+        pfd[i + 1].events = POLLIN;
+    }
+
+    long long now = now_ms();
+    int timeout = -1;
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (!timers[i].fn) continue;
+        long long wait = timers[i].due - now;
+        if (wait < 0) wait = 0;
+        if (timeout < 0 || wait < timeout) timeout = (int)wait;
+    }
+
+    int n = poll(pfd, (nfds_t)(num_watches + 1), timeout);
+    STAT_ADD(syscalls, 1);
+    if (n < 0 && errno != EINTR) die("poll");
+
+    now = now_ms();
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (!timers[i].fn || timers[i].due > now) continue;
+        void (*fn)(void) = timers[i].fn;
+        if (timers[i].interval) timers[i].due = now + timers[i].interval;
+        else timers[i].fn = NULL;
+        fn();
+    }
+    if (n <= 0) return;
+
+    // snapshot: handlers may (un)register watches
+    struct fd_watch ready[MAX_WATCHES];
+    int num_ready = 0;
+    for (int i = 0; i < num_watches; i++)
+        if (pfd[i + 1].revents) ready[num_ready++] = watches[i];
+    if (pfd[0].revents) {
+        process_keypress();
+        request_redraw();
     }
-    memcpy(&row->chars[row->length], s, len);
-    row->length = new_len;
-    row->chars[row->length] = '\0';
-    E.modified = true;
+    for (int i = 0; i < num_ready; i++) ready[i].on_ready(ready[i].fd);
 }
 
-/* ---------- Editor ops ---------- */
+/* ---------- Row arena ---------- */
 
-static void editor_insert_char(int c) {
-    // Safety: ensure there is at least one row to type into
-    if (E.num_rows == 0) editor_insert_row(0, "", 0);
-    if (E.cursor_y == E.num_rows) editor_insert_row(E.num_rows, "", 0);
-    editor_row_insert_char(&E.rows[E.cursor_y], E.cursor_x, c);
-    E.cursor_x++;
+/* Row text comes from an arena rather than one malloc per line. Edited
+ * rows take power-of-two chunks from per-size free lists; text loaded in
+ * bulk is bump-allocated from slabs and treated like mapped text. Slabs
+ * are only handed back on exit, in one pass over the slab list. */
+
+#define ARENA_MIN_SHIFT 4           // smallest chunk: 16 bytes
+#define ARENA_CLASSES 9             // largest chunk: 4096 bytes, bigger go to malloc
+#define ARENA_MAX_CHUNK ((size_t)1 << (ARENA_MIN_SHIFT + ARENA_CLASSES - 1))
+
+struct arena_slab {
+    struct arena_slab *next;
+    size_t used, size;
+    char data[];
+};
+
+static struct {
+    struct arena_slab *slabs;               // newest first; the head is bumped
+    void *free_list[ARENA_CLASSES];
+} arena;
+
+static char *arena_bump(size_t n, size_t align) {
+    struct arena_slab *s = arena.slabs;
+    size_t at = s ? (s->used + align - 1) & ~(align - 1) : 0;
+    if (!s || at + n > s->size) {
+        size_t size = n > ARENA_SLAB_SIZE / 4 ? n : ARENA_SLAB_SIZE;
+        struct arena_slab *ns = malloc(sizeof(*ns) + size);
+        if (!ns) die("malloc");
+        STAT_ADD(allocs, 1);
+        STAT_ADD(arena_bytes, size);
+        ns->size = size;
+        ns->used = 0;
+        if (s && size != ARENA_SLAB_SIZE) {
+            // an oversized slab holds just this block; keep bumping the head
+            ns->next = s->next;
+            s->next = ns;
+        } else {
+            ns->next = s;
+            arena.slabs = ns;
+        }
+        s = ns;
+        at = 0;
+    }
+    s->used = at + n;
+    return s->data + at;
 }
 
-// Fixed: handles empty buffer, end-of-buffer, and split line safely
-static void editor_insert_newline(void) {
-    // Case 1: completely empty file → first row, then a new empty row below
-    if (E.num_rows == 0) {
-        editor_insert_row(0, "", 0);
-        editor_insert_row(1, "", 0);
-        E.cursor_y = 1;
-        E.cursor_x = 0;
-        return;
+static int arena_class(size_t n) {
+    int c = 0;
+    while (((size_t)1 << (ARENA_MIN_SHIFT + c)) < n) c++;
+    return c;
+}
+
+// Allocate at least *cap bytes of row text; *cap becomes the real size.
+static char *arena_alloc(size_t *cap) {
+    STAT_ADD(allocs, 1);
+    if (*cap > ARENA_MAX_CHUNK) {
+        char *p = malloc(*cap);
+        if (!p) die("malloc");
+        STAT_ADD(chunk_bytes, *cap);
+        return p;
+    }
+    int c = arena_class(*cap);
+    *cap = (size_t)1 << (ARENA_MIN_SHIFT + c);
+    void *p = arena.free_list[c];
+    if (p) {
+        memcpy(&arena.free_list[c], p, sizeof(void *));
+        return p;
     }
+    return arena_bump(*cap, sizeof(void *));
+}
 
-    // Case 2: cursor is below last row → append a new blank line
-    if (E.cursor_y >= E.num_rows) {
-        editor_insert_row(E.num_rows, "", 0);
-        E.cursor_y = E.num_rows - 1; // newly created is last
-        E.cursor_x = 0;
-        return;
+static void arena_free(char *p, size_t cap) {
+    if (cap > ARENA_MAX_CHUNK) { free(p); STAT_SUB(chunk_bytes, cap); return; }
+    int c = arena_class(cap);
+    memcpy(p, &arena.free_list[c], sizeof(void *));
+    arena.free_list[c] = p;
+}
+
+// Drop all row text at once. Rows must not be used afterwards.
+static void arena_release(void) {
+    while (arena.slabs) {
+        struct arena_slab *next = arena.slabs->next;
+        free(arena.slabs);
+        arena.slabs = next;
     }
+    memset(arena.free_list, 0, sizeof(arena.free_list));
+}
 
-    // Case 3: at start of current line → insert blank line above
-    if (E.cursor_x == 0) {
-        editor_insert_row(E.cursor_y, "", 0);
-        E.cursor_y++;
-        E.cursor_x = 0;
+/* ---------- Row storage ---------- */
+
+static void mark_modified(void) {
+    E.buf->modified = true;
+    E.buf->change_count++;
+}
+
+// Record an edit of an owned row; the stamp tells cached renderings apart.
+static void row_touch(editor_row *row) {
+    mark_modified();
+    row->stamp = E.buf->change_count;
+}
+
+// Owned rows keep their spare capacity as a gap at byte `gap`, so the text
+// is chars[0, gap) followed by the last (length - gap) bytes of the buffer.
+// Edits at the gap are O(1); the gap only moves when the edit point does.
+static void row_gap_move(editor_row *row, size_t at) {
+    size_t gap_len = row->capacity - row->length;
+    if (at < row->gap)
+        memmove(row->chars + at + gap_len, row->chars + at, row->gap - at);
+    else if (at > row->gap)
+        memmove(row->chars + row->gap, row->chars + row->gap + gap_len, at - row->gap);
+    row->gap = at;
+}
+
+// Make sure the gap can take n more bytes, keeping it where it is.
+static void row_gap_reserve(editor_row *row, size_t n) {
+    size_t gap_len = row->capacity - row->length;
+    if (gap_len >= n) return;
+    size_t new_cap = row->capacity * 2;
+    if (new_cap < row->length + n + 16) new_cap = row->length + n + 16;
+    char *p = arena_alloc(&new_cap);
+    size_t tail = row->length - row->gap;
+    memcpy(p, row->chars, row->gap);
+    memcpy(p + new_cap - tail, row->chars + row->gap + gap_len, tail);
+    arena_free(row->chars, row->capacity);
+    row->chars = p; row->capacity = new_cap;
+}
+
+// The row text as two runs around the gap, without moving it.
+static void row_runs(const editor_row *row, const char **a, size_t *alen,
+                     const char **b, size_t *blen) {
+    if (row->capacity == 0) {
+        *a = row->chars; *alen = row->length;
+        *b = NULL; *blen = 0;
         return;
     }
+    *a = row->chars; *alen = row->gap;
+    *b = row->chars + row->gap + (row->capacity - row->length);
+    *blen = row->length - row->gap;
+}
 
-    // Case 4: split current line at cursor
-    editor_row *row = &E.rows[E.cursor_y];
-    const char *tail = &row->chars[E.cursor_x];
-    size_t tail_len = row->length - (size_t)E.cursor_x;
+// Contiguous row text; collapses the gap to the end if needed.
+static const char *row_text(editor_row *row) {
+    if (row->capacity && row->gap != row->length) row_gap_move(row, row->length);
+    return row->chars;
+}
 
-    editor_insert_row(E.cursor_y + 1, tail, tail_len);  // insert new row with tail
-    // reacquire row pointer in case realloc moved memory
-    row = &E.rows[E.cursor_y];
-    row->length = (size_t)E.cursor_x;
-    row->chars[row->length] = '\0';
+static char row_char(const editor_row *row, size_t at) {
+    if (row->capacity && at >= row->gap) at += row->capacity - row->length;
+    return row->chars[at];
+}
 
-    E.cursor_y++;
-    E.cursor_x = 0;
+static void editor_update_row(editor_row *row, const char *s, size_t len) {
+    if (row->capacity == 0) row->chars = NULL;   // never free a borrowed row
+    if (row->capacity < len) {
+        if (row->capacity) arena_free(row->chars, row->capacity);
+        size_t cap = len;
+        row->chars = arena_alloc(&cap);
+        row->capacity = cap;
+    }
+    if (len) memcpy(row->chars, s, len);
+    row->length = len;
+    row->gap = len;
+    row->stamp = E.buf->change_count;
 }
 
-static void editor_delete_char(void) {
-    if (E.num_rows == 0) return;
-    if (E.cursor_y >= E.num_rows) return;
-    if (E.cursor_x == 0 && E.cursor_y == 0) return;
-
-    editor_row *row = &E.rows[E.cursor_y];
-    if (E.cursor_x > 0) {
-        editor_row_delete_char(row, E.cursor_x - 1);
-        E.cursor_x--;
-    } else {
-        // merge with previous line
-        int prev = E.cursor_y - 1;
-        int prev_len = (int)E.rows[prev].length;
-        editor_row_append_string(&E.rows[prev], row->chars, row->length);
-        editor_delete_row(E.cursor_y);
-        E.cursor_y = prev;
-        E.cursor_x = prev_len;
+// Copy-on-write: give a row that borrows from the mapping its own buffer.
+static void editor_row_own(editor_row *row) {
+    if (row->capacity) return;
+    size_t cap = row->length + 16;
+    char *p = arena_alloc(&cap);
+    if (row->length) memcpy(p, row->chars, row->length);
+    row->chars = p; row->capacity = cap;
+    row->gap = row->length;
+}
+
+static void editor_free_row(editor_row *row) {
+    if (row->capacity) arena_free(row->chars, row->capacity);
+    row->chars = NULL;
+    row->length = row->capacity = row->gap = 0;
+}
+
+/* ---------- Newline scanning ---------- */
+
+/* newline_scan(p, end, limit, &lines, &cr) walks forward over at most
+ * `limit` newlines and returns the byte after the last one it counted,
+ * or `end` if it ran out first. *lines gets the count; *cr is set when a
+ * '\r' was seen on the way (it may also look a little past the stop).
+ * The vector variants are picked once at startup. */
+
+typedef const char *(*newline_scan_fn)(const char *p, const char *end, int limit,
+                                       int *lines, bool *cr);
+
+static const char *newline_scan_scalar(const char *p, const char *end, int limit,
+                                       int *lines, bool *cr) {
+    int n = 0;
+    bool seen_cr = false;
+    while (p < end && n < limit) {
+        char c = *p++;
+        if (c == '\n') n++;
+        else if (c == '\r') seen_cr = true;
     }
+    if (seen_cr) *cr = true;
+    *lines = n;
+    return p;
 }
 
-/* ---------- File I/O ---------- */
+// Offset of the k-th (1-based) set bit of mask.
+static int nth_bit(unsigned long long mask, int k) {
+    while (--k) mask &= mask - 1;
+    return __builtin_ctzll(mask);
+}
 
-static void open_file(const char *path) {
-    if (path) {
-        strncpy(E.filename, path, MAX_FILENAME - 1);
-        E.filename[MAX_FILENAME - 1] = '\0';
-    } else {
-        E.filename[0] = '\0';
+#if defined(__x86_64__) || defined(__i386__)
+static const char *newline_scan_sse2(const char *p, const char *end, int limit,
+                                     int *lines, bool *cr) {
+    const __m128i nl = _mm_set1_epi8('\n'), ret = _mm_set1_epi8('\r');
+    __m128i crs = _mm_setzero_si128();
+    int n = 0;
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        crs = _mm_or_si128(crs, _mm_cmpeq_epi8(v, ret));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        int c = __builtin_popcount(m);
+        if (n + c >= limit) {
+            p += nth_bit(m, limit - n) + 1;
+            n = limit;
+            break;
+        }
+        n += c;
+        p += 16;
     }
+    if (_mm_movemask_epi8(crs)) *cr = true;
+    int tail = 0;
+    if (n < limit) p = newline_scan_scalar(p, end, limit - n, &tail, cr);
+    *lines = n + tail;
+    return p;
+}
 
-    FILE *fp = path ? fopen(path, "r") : NULL;
-    if (!fp) {
-        set_status_message("New file: %s", E.filename[0] ? E.filename : "(unnamed)");
-        return;
+__attribute__((target("avx2,popcnt")))
+static const char *newline_scan_avx2(const char *p, const char *end, int limit,
+                                     int *lines, bool *cr) {
+    const __m256i nl = _mm256_set1_epi8('\n'), ret = _mm256_set1_epi8('\r');
+    __m256i crs = _mm256_setzero_si256();
+    int n = 0;
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        crs = _mm256_or_si256(crs, _mm256_cmpeq_epi8(v, ret));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        int c = __builtin_popcount(m);
+        if (n + c >= limit) {
+            p += nth_bit(m, limit - n) + 1;
+            n = limit;
+            break;
+        }
+        n += c;
+        p += 32;
     }
+    if (_mm256_movemask_epi8(crs)) *cr = true;
+    int tail = 0;
+    if (n < limit) p = newline_scan_scalar(p, end, limit - n, &tail, cr);
+    *lines = n + tail;
+    return p;
+}
+#elif defined(__aarch64__)
+// Narrow a byte-compare result to 4 bits per byte in a 64-bit mask.
+static unsigned long long neon_mask(uint8x16_t eq) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
 
-    char *line = NULL;
-    size_t cap = 0;
-    ssize_t len;
-    while ((len = getline(&line, &cap, fp)) != -1) {
-        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
-        editor_insert_row(E.num_rows, line, (size_t)len);
+static const char *newline_scan_neon(const char *p, const char *end, int limit,
+                                     int *lines, bool *cr) {
+    const uint8x16_t nl = vdupq_n_u8('\n'), ret = vdupq_n_u8('\r');
+    uint8x16_t crs = vdupq_n_u8(0);
+    int n = 0;
+    while (end - p >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)p);
+        crs = vorrq_u8(crs, vceqq_u8(v, ret));
+        unsigned long long m = neon_mask(vceqq_u8(v, nl)) & 0x1111111111111111ULL;
+        int c = __builtin_popcountll(m);
+        if (n + c >= limit) {
+            p += nth_bit(m, limit - n) / 4 + 1;
+            n = limit;
+            break;
+        }
+        n += c;
+        p += 16;
     }
-    free(line);
-    fclose(fp);
-    E.modified = false;
-    set_status_message("Opened: %s", E.filename);
+    if (vmaxvq_u8(crs)) *cr = true;
+    int tail = 0;
+    if (n < limit) p = newline_scan_scalar(p, end, limit - n, &tail, cr);
+    *lines = n + tail;
+    return p;
 }
+#endif
 
-static void save_file(void) {
-    if (!E.filename[0]) { set_status_message("ERROR: No filename"); return; }
-    FILE *fp = fopen(E.filename, "w");
-    if (!fp) { set_status_message("I/O error: %s", strerror(errno)); return; }
-    for (int i = 0; i < E.num_rows; i++)
-        fprintf(fp, "%s\n", E.rows[i].chars ? E.rows[i].chars : "");
-    fclose(fp);
-    E.modified = false;
-    set_status_message("Saved: %s", E.filename);
+static newline_scan_fn newline_scan = newline_scan_scalar;
+
+static void newline_scan_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    newline_scan = __builtin_cpu_supports("avx2") ? newline_scan_avx2 : newline_scan_sse2;
+#elif defined(__aarch64__)
+    newline_scan = newline_scan_neon;
+#endif
 }
 
-/* ---------- Screen drawing ---------- */
+/* ---------- UTF-8 ---------- */
 
-struct abuf { char *b; int len; };
-#define ABUF_INIT {NULL, 0}
+/* Rows hold raw bytes; these helpers find character boundaries and
+ * display widths in them. A malformed sequence counts as one character
+ * per byte, so every byte belongs to exactly one character. */
 
-static void ab_append(struct abuf *ab, const char *s, int len) {
-    char *p = realloc(ab->b, (size_t)ab->len + (size_t)len);
-    if (!p) return;
-    memcpy(p + ab->len, s, (size_t)len);
-    ab->b = p; ab->len += len;
+// Decode the character at byte `at`; returns its length and sets *cp to
+// the code point, or -1 for a malformed byte.
+static size_t row_decode(const editor_row *row, size_t at, int *cp) {
+    unsigned char c = (unsigned char)row_char(row, at);
+    size_t n;
+    int v, min;
+    if (c < 0x80) { *cp = c; return 1; }
+    if (c >= 0xc2 && c < 0xe0) { n = 2; v = c & 0x1f; min = 0x80; }
+    else if (c >= 0xe0 && c < 0xf0) { n = 3; v = c & 0x0f; min = 0x800; }
+    else if (c >= 0xf0 && c < 0xf5) { n = 4; v = c & 0x07; min = 0x10000; }
+    else { *cp = -1; return 1; }
+    if (at + n > row->length) { *cp = -1; return 1; }
+    for (size_t i = 1; i < n; i++) {
+        unsigned char d = (unsigned char)row_char(row, at + i);
+        if ((d & 0xc0) != 0x80) { *cp = -1; return 1; }
+        v = v << 6 | (d & 0x3f);
+    }
+    if (v < min || v > 0x10ffff || (v >= 0xd800 && v < 0xe000)) { *cp = -1; return 1; }
+    *cp = v;
+    return n;
 }
-static void ab_free(struct abuf *ab) { free(ab->b); ab->b = NULL; ab->len = 0; }
 
-static void editor_scroll(void) {
-    if (E.cursor_y < E.row_offset) E.row_offset = E.cursor_y;
-    if (E.cursor_y >= E.row_offset + (E.screen_rows - 2))
-        E.row_offset = E.cursor_y - (E.screen_rows - 2) + 1;
+static size_t row_next_char(const editor_row *row, size_t at) {
+    int cp;
+    return at < row->length ? at + row_decode(row, at, &cp) : at;
+}
 
-    if (E.cursor_x < E.col_offset) E.col_offset = E.cursor_x;
-    if (E.cursor_x >= E.col_offset + E.screen_cols)
-        E.col_offset = E.cursor_x - E.screen_cols + 1;
+static size_t row_prev_char(const editor_row *row, size_t at) {
+    int cp;
+    if (at == 0) return 0;
+    if ((unsigned char)row_char(row, at - 1) < 0x80) return at - 1;
+    for (size_t k = 2; k <= 4 && k <= at; k++)
+        if (row_decode(row, at - k, &cp) == k) return at - k;
+    return at - 1;
 }
 
-static void draw_rows(struct abuf *ab) {
-    int text_rows = E.screen_rows - 2;
-    for (int y = 0; y < text_rows; y++) {
-        int filerow = y + E.row_offset;
-        if (filerow >= E.num_rows) {
-            ab_append(ab, "~\x1b[K\r\n", 6);
-        } else {
-            editor_row *row = &E.rows[filerow];
-            int len = (int)row->length - E.col_offset;
-            if (len < 0) len = 0;
-            if (len > E.screen_cols) len = E.screen_cols;
-            if (len > 0) ab_append(ab, &row->chars[E.col_offset], len);
-            ab_append(ab, "\x1b[K\r\n", 5);
-        }
+struct cp_range { int lo, hi; };
+
+// Combining marks and other zero-width characters.
+static const struct cp_range zero_width[] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+    {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a},
+    {0x064b, 0x065f}, {0x0670, 0x0670}, {0x06d6, 0x06dc}, {0x06df, 0x06e4},
+    {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0900, 0x0902}, {0x093a, 0x093a},
+    {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957},
+    {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x1ab0, 0x1aff},
+    {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064},
+    {0x20d0, 0x20ff}, {0x302a, 0x302d}, {0x3099, 0x309a}, {0xfe00, 0xfe0f},
+    {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0xe0100, 0xe01ef},
+};
+
+// East Asian wide and fullwidth characters, and emoji.
+static const struct cp_range double_width[] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+    {0x23f0, 0x23f0}, {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267f, 0x267f}, {0x2693, 0x2693}, {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26ce, 0x26ce},
+    {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b},
+    {0x2728, 0x2728}, {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27b0, 0x27b0}, {0x27bf, 0x27bf},
+    {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55}, {0x2e80, 0x303e},
+    {0x3041, 0x3096}, {0x309b, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff},
+    {0xa000, 0xa4cf}, {0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff},
+    {0xfe10, 0xfe19}, {0xfe30, 0xfe6f}, {0xff00, 0xff60}, {0xffe0, 0xffe6},
+    {0x16fe0, 0x16fe4}, {0x17000, 0x18cff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004},
+    {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251},
+    {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f9ff},
+    {0x1fa70, 0x1faff}, {0x20000, 0x2fffd}, {0x30000, 0x3fffd},
+};
+
+static bool cp_in(int cp, const struct cp_range *t, size_t n) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cp < t[mid].lo) hi = mid;
+        else if (cp > t[mid].hi) lo = mid + 1;
+        else return true;
     }
+    return false;
 }
 
-static void draw_status_bar(struct abuf *ab) {
-    ab_append(ab, "\x1b[7m", 3);
-    char status[160];
-    int len = snprintf(status, sizeof(status), "[%s] %s",
-        E.filename[0] ? E.filename : "[No Name]",
-        E.modified ? "*" : "");
-    if (len > E.screen_cols) len = E.screen_cols;
-    ab_append(ab, status, len);
-    while (len < E.screen_cols) { ab_append(ab, " ", 1); len++; }
-    ab_append(ab, "\x1b[m\r\n", 5);
+// Columns taken by a printable code point.
+static int cp_width(int cp) {
+    if (cp < 0x300) return 1;
+    if (cp_in(cp, zero_width, sizeof zero_width / sizeof *zero_width)) return 0;
+    if (cp >= 0x1100 && cp_in(cp, double_width, sizeof double_width / sizeof *double_width)) return 2;
+    return 1;
 }
 
-static void draw_message_bar(struct abuf *ab) {
-    ab_append(ab, "\x1b[K", 3);
-    int msglen = (int)strlen(E.status_msg);
-    if (msglen > E.screen_cols) msglen = E.screen_cols;
-    if (msglen > 0) ab_append(ab, E.status_msg, msglen);
+/* text_class() tells what displaying some row text takes: TEXT_PLAIN is
+ * printable ASCII only (bytes are columns), TEXT_CTRL has tabs or control
+ * bytes as well, TEXT_UTF8 anything at or above 0x80. */
+
+enum { TEXT_PLAIN, TEXT_CTRL, TEXT_UTF8 };
+
+static int text_class(const char *s, size_t n) {
+    int cls = TEXT_PLAIN;
+    size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    const __m128i sp = _mm_set1_epi8(' '), del = _mm_set1_epi8(127);
+    __m128i ctrl = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(v)) return TEXT_UTF8;
+        ctrl = _mm_or_si128(ctrl, _mm_or_si128(_mm_cmplt_epi8(v, sp), _mm_cmpeq_epi8(v, del)));
+    }
+    if (_mm_movemask_epi8(ctrl)) cls = TEXT_CTRL;
+#elif defined(__aarch64__)
+    const uint8x16_t sp = vdupq_n_u8(' '), del = vdupq_n_u8(127), hi = vdupq_n_u8(0x80);
+    uint8x16_t ctrl = vdupq_n_u8(0);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(s + i));
+        if (vmaxvq_u8(vcgeq_u8(v, hi))) return TEXT_UTF8;
+        ctrl = vorrq_u8(ctrl, vorrq_u8(vcltq_u8(v, sp), vceqq_u8(v, del)));
+    }
+    if (vmaxvq_u8(ctrl)) cls = TEXT_CTRL;
+#endif
+    for (; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x80) return TEXT_UTF8;
+        if (c < ' ' || c == 127) cls = TEXT_CTRL;
+    }
+    return cls;
 }
 
-static void refresh_screen(void) {
-    editor_scroll();
-    struct abuf ab = ABUF_INIT;
-    ab_append(&ab, "\x1b[?25l\x1b[H", 9);     // hide cursor, go home
-    draw_rows(&ab);
-    draw_status_bar(&ab);
-    draw_message_bar(&ab);
+/* ---------- Row table ---------- */
 
-    // place cursor
-    int cy = (E.cursor_y - E.row_offset) + 1;
-    int cx = (E.cursor_x - E.col_offset) + 1;
-    if (cy < 1) cy = 1; if (cx < 1) cx = 1;
-    char pos[32];
-    int n = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", cy, cx);
-    ab_append(&ab, pos, n);
-    ab_append(&ab, "\x1b[?25h", 6);          // show cursor
+static void row_index_rebuild(void) {
+    int *idx = realloc(E.buf->block_index, sizeof(int) * (size_t)(E.buf->num_blocks + 1));
+    if (!idx) die("realloc");
+    E.buf->block_index = idx;
+    idx[0] = 0;
+    for (int i = 1; i <= E.buf->num_blocks; i++) idx[i] = E.buf->blocks[i - 1].num_rows;
+    for (int i = 1; i <= E.buf->num_blocks; i++) {
+        int j = i + (i & -i);
+        if (j <= E.buf->num_blocks) idx[j] += idx[i];
+    }
+    E.buf->block_index_stale = false;
+}
 
-    wrlit(ab.b, (size_t)ab.len);
-    ab_free(&ab);
+static void row_index_add(int b, int delta) {
+    if (!E.buf->block_index_stale)
+        for (int i = b + 1; i <= E.buf->num_blocks; i += i & -i) E.buf->block_index[i] += delta;
+    if (E.buf->cache_block > b) E.buf->cache_start += delta;
 }
 
-static void set_status_message(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.status_msg, sizeof(E.status_msg), fmt, ap);
-    va_end(ap);
+// Map a line number to its block in O(log n); *start gets the block's
+// first line. Sequential access (drawing, loading) hits the cache instead.
+static int row_find_block(int at, int *start) {
+    int c = E.buf->cache_block;
+    if (c >= 0 && c < E.buf->num_blocks && at >= E.buf->cache_start) {
+        if (at < E.buf->cache_start + E.buf->blocks[c].num_rows) { *start = E.buf->cache_start; return c; }
+        int next = E.buf->cache_start + E.buf->blocks[c].num_rows;
+        if (c + 1 < E.buf->num_blocks && at < next + E.buf->blocks[c + 1].num_rows) {
+            E.buf->cache_block = c + 1; E.buf->cache_start = next;
+            *start = next; return c + 1;
+        }
+    }
+    if (E.buf->block_index_stale) row_index_rebuild();
+    int pos = 0, rem = at, step = 1;
+    while (step * 2 <= E.buf->num_blocks) step *= 2;
+    for (; step; step >>= 1) {
+        if (pos + step <= E.buf->num_blocks && E.buf->block_index[pos + step] <= rem) {
+            pos += step;
+            rem -= E.buf->block_index[pos];
+        }
+    }
+    E.buf->cache_block = pos;
+    E.buf->cache_start = at - rem;
+    *start = E.buf->cache_start;
+    return pos;
 }
 
-/* ---------- Input ---------- */
+static int row_find_loaded_block(int at, int *start);
 
-static void editor_move_cursor(int key) {
-    if (E.num_rows == 0) return;
-    editor_row *row = (E.cursor_y >= E.num_rows) ? NULL : &E.rows[E.cursor_y];
+/* Every block can keep the highlighting lexer's state at the end of each
+ * of its rows (blk->hl, as long as the rows; HL_UNKNOWN where not known).
+ * Rows before E.buf->hl_from have the right state; a change to a row
+ * forgets its state and moves hl_from back to it. */
 
-    switch (key) {
-        case 'A': if (E.cursor_y > 0) E.cursor_y--; break;                 // Up
-        case 'B': if (E.cursor_y < E.num_rows - 1) E.cursor_y++; break;    // Down
-        case 'D':                                                         // Left
-            if (E.cursor_x > 0) E.cursor_x--;
-            else if (E.cursor_y > 0) { E.cursor_y--; E.cursor_x = (int)E.rows[E.cursor_y].length; }
-            break;
-        case 'C':                                                         // Right
-            if (row && E.cursor_x < (int)row->length) E.cursor_x++;
-            else if (E.cursor_y < E.num_rows - 1) { E.cursor_y++; E.cursor_x = 0; }
-            break;
+static void row_hl_stale(int at) {
+    if (at < E.buf->hl_from) E.buf->hl_from = at;
+}
+
+static int row_hl(int at) {
+    int start;
+    const row_block *blk = &E.buf->blocks[row_find_block(at, &start)];
+    return blk->hl ? blk->hl[at - start] : HL_UNKNOWN;
+}
+
+static void row_set_hl(int at, int state) {
+    int start;
+    row_block *blk = &E.buf->blocks[row_find_block(at, &start)];
+    if (!blk->hl) {
+        size_t n = (size_t)(blk->capacity > blk->num_rows ? blk->capacity : blk->num_rows);
+        if (!(blk->hl = malloc(n))) die("malloc");
+        memset(blk->hl, HL_UNKNOWN, n);
     }
-    row = (E.cursor_y >= E.num_rows) ? NULL : &E.rows[E.cursor_y];
-    int rowlen = row ? (int)row->length : 0;
-    if (E.cursor_x > rowlen) E.cursor_x = rowlen;
+    blk->hl[at - start] = (uint8_t)state;
 }
 
-static int read_key(void) {
-    unsigned char c;
-    if (read(STDIN_FILENO, &c, 1) != 1) return -1;
-    if (c != '\x1b') return c;
-    unsigned char s1; if (read(STDIN_FILENO, &s1, 1) != 1) return '\x1b';
-    if (s1 != '[') return '\x1b';
-    unsigned char s2; if (read(STDIN_FILENO, &s2, 1) != 1) return '\x1b';
-    switch (s2) { case 'A': case 'B': case 'C': case 'D': return s2; }
-    return '\x1b';
+// First row at or after `from` with an unknown state.
+static int row_hl_next_unknown(int from) {
+    if (from >= E.buf->num_rows) return E.buf->num_rows;
+    int start;
+    int b = row_find_block(from, &start);
+    for (; b < E.buf->num_blocks; start += E.buf->blocks[b++].num_rows) {
+        const row_block *blk = &E.buf->blocks[b];
+        int i = from > start ? from - start : 0;
+        if (!blk->hl) return start + i;
+        const uint8_t *u = memchr(blk->hl + i, HL_UNKNOWN, (size_t)(blk->num_rows - i));
+        if (u) return start + (int)(u - blk->hl);
+    }
+    return E.buf->num_rows;
 }
 
-static void process_keypress(void) {
-    int k = read_key();
-    if (k < 0) return;
+// Row pointers stay valid until their own block changes: materializing
+// or splitting other blocks only moves block descriptors, not rows. Rows
+// are fetched this way to be changed, so their lexer state goes.
+static editor_row *row_at(int at) {
+    int start;
+    int b = row_find_loaded_block(at, &start);
+    row_block *blk = &E.buf->blocks[b];
+    if (blk->hl) blk->hl[at - start] = HL_UNKNOWN;
+    row_hl_stale(at);
+    return &blk->rows[at - start];
+}
 
-    switch (k) {
-        case '\r': editor_insert_newline(); break;
-        case 17:   /* Ctrl-Q */ exit(0);   // atexit() will clean up the TTY
-        case 19:   /* Ctrl-S */ save_file(); break;
-        case 127:  /* Backspace */ editor_delete_char(); break;
-        case 'A': case 'B': case 'C': case 'D':
-            editor_move_cursor(k); break;
-        default:
-            if (k >= 32 && k < 127) editor_insert_char(k);
-            break;
+static void row_block_reserve(row_block *blk, int n) {
+    if (n <= blk->capacity) return;
+    int cap = blk->capacity ? blk->capacity : 16;
+    while (cap < n) cap *= 2;
+    if (cap > ROW_BLOCK_SIZE) cap = ROW_BLOCK_SIZE;
+    editor_row *nr = realloc(blk->rows, sizeof(editor_row) * (size_t)cap);
+    if (!nr) die("realloc");
+    STAT_ADD(allocs, 1);
+    blk->rows = nr;
+    blk->capacity = cap;
+    if (blk->hl && !(blk->hl = realloc(blk->hl, (size_t)cap))) die("realloc");
+}
+
+// Room for n more blocks in the block array (geometric growth).
+static void row_table_reserve(int n) {
+    if (E.buf->num_blocks + n <= E.buf->block_capacity) return;
+    int cap = E.buf->block_capacity ? E.buf->block_capacity : 16;
+    while (cap < E.buf->num_blocks + n) cap *= 2;
+    row_block *nb = realloc(E.buf->blocks, sizeof(row_block) * (size_t)cap);
+    if (!nb) die("realloc");
+    STAT_ADD(allocs, 1);
+    E.buf->blocks = nb;
+    E.buf->block_capacity = cap;
+}
+
+// Insert n empty blocks at index b. Changes the block layout, so the
+// index is rebuilt lazily and the lookup cache is dropped.
+static row_block *row_table_insert_blocks(int b, int n) {
+    row_table_reserve(n);
+    memmove(&E.buf->blocks[b + n], &E.buf->blocks[b], sizeof(row_block) * (size_t)(E.buf->num_blocks - b));
+    memset(&E.buf->blocks[b], 0, sizeof(row_block) * (size_t)n);
+    E.buf->num_blocks += n;
+    E.buf->block_index_stale = true;
+    E.buf->cache_block = -1;
+    return &E.buf->blocks[b];
+}
+
+static row_block *row_table_insert_block(int b) {
+    return row_table_insert_blocks(b, 1);
+}
+
+static void row_table_remove_block(int b) {
+    free(E.buf->blocks[b].rows);
+    free(E.buf->blocks[b].hl);
+    memmove(&E.buf->blocks[b], &E.buf->blocks[b + 1], sizeof(row_block) * (size_t)(E.buf->num_blocks - b - 1));
+    E.buf->num_blocks--;
+    E.buf->block_index_stale = true;
+    E.buf->cache_block = -1;
+}
+
+// Move the upper half of a full block into a new block after it.
+static void row_table_split_block(int b) {
+    row_block *nb = row_table_insert_block(b + 1);
+    row_block *blk = &E.buf->blocks[b];
+    int keep = blk->num_rows / 2;
+    row_block_reserve(nb, blk->num_rows - keep);
+    memcpy(nb->rows, &blk->rows[keep], sizeof(editor_row) * (size_t)(blk->num_rows - keep));
+    if (blk->hl) {
+        if (!(nb->hl = malloc((size_t)nb->capacity))) die("malloc");
+        memcpy(nb->hl, &blk->hl[keep], (size_t)(blk->num_rows - keep));
     }
+    nb->num_rows = blk->num_rows - keep;
+    blk->num_rows = keep;
 }
 
-/* ---------- Resize Handling ---------- */
-static volatile sig_atomic_t ned_need_resize = 0;
-static void on_winch(int sig) { (void)sig; ned_need_resize = 1; }
+// Split one line off the front of [p, end): the row borrows it, minus the
+// newline (and the \r of a \r\n). Returns the start of the next line.
+static const char *scan_line(const char *p, const char *end, editor_row *row) {
+    int n;
+    bool cr = false;
+    const char *next = newline_scan(p, end, 1, &n, &cr);
+    size_t len = (size_t)(next - p) - (size_t)n;
+    if (n && cr && len > 0 && p[len - 1] == '\r') len--;
+    row->chars = (char *)p;
+    row->length = len;
+    row->capacity = row->gap = 0;
+    return next;
+}
 
-/* ---------- Init / Main ---------- */
+// Materialize a span block: build its rows (still borrowing from the
+// mapping), spread over as many blocks as it needs.
+static void row_block_load(int b) {
+    const char *p = E.buf->blocks[b].span, *end = p + E.buf->blocks[b].span_len;
+    free(E.buf->blocks[b].offs);
+    E.buf->blocks[b].offs = NULL;
+    uint8_t *hl = E.buf->blocks[b].hl;
+    E.buf->blocks[b].hl = NULL;
+    int n = E.buf->blocks[b].num_rows;
+    int k = (n + ROW_BLOCK_SIZE - 1) / ROW_BLOCK_SIZE;
+    if (k > 1) row_table_insert_blocks(b + 1, k - 1);
+    for (int j = 0; j < k; j++) {
+        row_block *blk = &E.buf->blocks[b + j];
+        int cnt = j < k - 1 ? ROW_BLOCK_SIZE : n - (k - 1) * ROW_BLOCK_SIZE;
+        blk->span = NULL;
+        blk->span_len = 0;
+        row_block_reserve(blk, cnt);
+        for (int i = 0; i < cnt; i++) p = scan_line(p, end, &blk->rows[i]);
+        blk->num_rows = cnt;
+        if (hl) {
+            if (!(blk->hl = malloc((size_t)blk->capacity))) die("malloc");
+            memcpy(blk->hl, hl + (size_t)j * ROW_BLOCK_SIZE, (size_t)cnt);
+        }
+    }
+    free(hl);
+    E.buf->block_index_stale = true;
+    E.buf->cache_block = -1;
+}
 
-static void init_editor(void) {
-    E.cursor_x = E.cursor_y = 0;
-    E.row_offset = E.col_offset = 0;
-    E.num_rows = 0;
-    E.rows = NULL;
-    E.filename[0] = '\0';
-    E.modified = false;
-    E.status_msg[0] = '\0';
-    if (get_window_size(&E.screen_rows, &E.screen_cols) == -1) {
-        E.screen_rows = SCREEN_ROWS; E.screen_cols = SCREEN_COLS;
+// Index the lines of a span block. A span over 4 GB does not fit the
+// offsets, so the caller builds rows instead.
+static bool row_block_compact(row_block *blk) {
+    if (blk->offs) return true;
+    if (blk->span_len > UINT32_MAX) return false;
+    uint32_t *o = malloc(sizeof(uint32_t) * ((size_t)blk->num_rows + 1));
+    if (!o) die("malloc");
+    STAT_ADD(allocs, 1);
+    const char *p = blk->span, *end = p + blk->span_len;
+    for (int i = 0; i < blk->num_rows; i++) {
+        int n;
+        bool cr = false;
+        o[i] = (uint32_t)(p - blk->span);
+        p = newline_scan(p, end, 1, &n, &cr);
     }
+    o[blk->num_rows] = (uint32_t)blk->span_len;
+    blk->offs = o;
+    return true;
 }
 
-int main(int argc, char *argv[]) {
-    enable_raw_mode();
-    init_editor();
-    signal(SIGWINCH, on_winch);
+// A copy of row `at` for reading. Unedited lines come straight from the
+// span as borrowed rows, without building the block's rows.
+static editor_row row_get(int at) {
+    int start;
+    int b = row_find_block(at, &start);
+    row_block *blk = &E.buf->blocks[b];
+    if (blk->span && !row_block_compact(blk)) {
+        row_block_load(b);
+        b = row_find_block(at, &start);
+        blk = &E.buf->blocks[b];
+    }
+    if (!blk->span) return blk->rows[at - start];
+
+    int i = at - start;
+    const char *p = blk->span + blk->offs[i], *e = blk->span + blk->offs[i + 1];
+    if (e > p && e[-1] == '\n') {
+        e--;
+        if (e > p && e[-1] == '\r') e--;
+    }
+    return (editor_row){ .chars = (char *)p, .length = (size_t)(e - p) };
+}
 
-    if (argc > 1) open_file(argv[1]);
-    else set_status_message("Help: Ctrl+S=Save | Ctrl+Q=Quit");
+static size_t row_length(int at) {
+    return row_get(at).length;
+}
 
-    for (;;) {
-        if (ned_need_resize) {
-            ned_need_resize = 0;
-            get_window_size(&E.screen_rows, &E.screen_cols);
+// Like row_find_block(), but the block is materialized first if needed.
+static int row_find_loaded_block(int at, int *start) {
+    int b = row_find_block(at, start);
+    if (!E.buf->blocks[b].span) return b;
+    row_block_load(b);
+    return row_find_block(at, start);
+}
+
+// Append [p, p + len), holding `lines` lines, as span text. Text that
+// continues a small last span block is merged into it.
+static void row_table_append_span(const char *p, size_t len, int lines) {
+    row_block *blk = E.buf->num_blocks ? &E.buf->blocks[E.buf->num_blocks - 1] : NULL;
+    if (blk && blk->span && blk->span + blk->span_len == p &&
+        blk->num_rows + lines <= ROW_BLOCK_SIZE) {
+        free(blk->offs);
+        blk->offs = NULL;
+        if (blk->hl) {
+            if (!(blk->hl = realloc(blk->hl, (size_t)(blk->num_rows + lines)))) die("realloc");
+            memset(blk->hl + blk->num_rows, HL_UNKNOWN, (size_t)lines);
         }
-        refresh_screen();
-        process_keypress();
+        blk->span_len += len;
+        blk->num_rows += lines;
+        row_index_add(E.buf->num_blocks - 1, lines);
+    } else {
+        blk = row_table_insert_block(E.buf->num_blocks);
+        blk->span = p;
+        blk->span_len = len;
+        blk->num_rows = lines;
+    }
+    E.buf->num_rows += lines;
+}
+
+// Take back the last row without counting it as an edit (follow mode
+// reads an unterminated last line again once it grows).
+static void row_table_drop_last(void) {
+    int b = E.buf->num_blocks - 1;
+    row_block *blk = &E.buf->blocks[b];
+    if (blk->span && blk->num_rows > 1 && row_block_compact(blk)) {
+        blk->span_len = blk->offs[--blk->num_rows];
+    } else {
+        if (blk->span) row_block_load(b);
+        b = E.buf->num_blocks - 1;
+        blk = &E.buf->blocks[b];
+        editor_free_row(&blk->rows[--blk->num_rows]);
+    }
+    E.buf->num_rows--;
+    row_hl_stale(E.buf->num_rows);
+    if (blk->num_rows == 0) row_table_remove_block(b);
+    else row_index_add(b, -1);
+}
+
+// Drop every row, as if nothing had been loaded.
+static void row_table_clear(void) {
+    for (int b = 0; b < E.buf->num_blocks; b++) {
+        row_block *blk = &E.buf->blocks[b];
+        if (!blk->span)
+            for (int i = 0; i < blk->num_rows; i++) editor_free_row(&blk->rows[i]);
+        free(blk->rows);
+        free(blk->offs);
+        free(blk->hl);
+    }
+    E.buf->num_blocks = 0;
+    E.buf->num_rows = 0;
+    E.buf->num_marks = 0;
+    E.buf->hl_from = 0;
+    E.buf->block_index_stale = true;
+    E.buf->cache_block = -1;
+}
+
+// Bookmarks stay with their text: they move down when a line is opened
+// at or above them and up when one above them goes; a bookmark on a
+// deleted line goes with it.
+static void row_marks_opened(int at) {
+    for (int i = 0; i < E.buf->num_marks; i++)
+        if (E.buf->marks[i] >= at) E.buf->marks[i]++;
+}
+
+static void row_marks_deleted(int at) {
+    int n = 0;
+    for (int i = 0; i < E.buf->num_marks; i++) {
+        int m = E.buf->marks[i];
+        if (m != at) E.buf->marks[n++] = m > at ? m - 1 : m;
+    }
+    E.buf->num_marks = n;
+}
+
+static void editor_delete_row(int at) {
+    if (at < 0 || at >= E.buf->num_rows) return;
+    int start;
+    int b = row_find_loaded_block(at, &start);
+    row_block *blk = &E.buf->blocks[b];
+    editor_free_row(&blk->rows[at - start]);
+    memmove(&blk->rows[at - start], &blk->rows[at - start + 1],
+            sizeof(editor_row) * (size_t)(blk->num_rows - (at - start) - 1));
+    if (blk->hl) memmove(&blk->hl[at - start], &blk->hl[at - start + 1], (size_t)(blk->num_rows - (at - start) - 1));
+    row_hl_stale(at);
+    row_marks_deleted(at);
+    blk->num_rows--;
+    E.buf->num_rows--;
+    if (blk->num_rows == 0) row_table_remove_block(b);
+    else row_index_add(b, -1);
+    if (E.buf->cursor_y >= E.buf->num_rows) E.buf->cursor_y = E.buf->num_rows ? (E.buf->num_rows - 1) : 0;
+    if (E.buf->num_rows) {
+        int rowlen = (int)row_length(E.buf->cursor_y);
+        if (E.buf->cursor_x > rowlen) E.buf->cursor_x = rowlen;
+    } else {
+        E.buf->cursor_x = 0;
+    }
+    mark_modified();
+}
+
+static editor_row *editor_open_row(int at) {
+    int b, start;
+    if (at == E.buf->num_rows) {
+        // appending: fill the last block, start a new one when it is full
+        // (or still a span)
+        if (E.buf->num_blocks == 0 || E.buf->blocks[E.buf->num_blocks - 1].span ||
+            E.buf->blocks[E.buf->num_blocks - 1].num_rows == ROW_BLOCK_SIZE)
+            row_table_insert_block(E.buf->num_blocks);
+        b = E.buf->num_blocks - 1;
+        start = E.buf->num_rows - E.buf->blocks[b].num_rows;
+    } else {
+        b = row_find_loaded_block(at, &start);
+        if (E.buf->blocks[b].num_rows == ROW_BLOCK_SIZE) {
+            row_table_split_block(b);
+            if (at - start >= E.buf->blocks[b].num_rows) {
+                start += E.buf->blocks[b].num_rows;
+                b++;
+            }
+        }
+    }
+    row_block *blk = &E.buf->blocks[b];
+    int i = at - start;
+    row_block_reserve(blk, blk->num_rows + 1);
+    memmove(&blk->rows[i + 1], &blk->rows[i], sizeof(editor_row) * (size_t)(blk->num_rows - i));
+    if (blk->hl) {
+        memmove(&blk->hl[i + 1], &blk->hl[i], (size_t)(blk->num_rows - i));
+        blk->hl[i] = HL_UNKNOWN;
+    }
+    row_hl_stale(at);
+    row_marks_opened(at);
+    blk->num_rows++;
+    E.buf->num_rows++;
+    row_index_add(b, 1);
+    mark_modified();
+    editor_row *row = &blk->rows[i];
+    row->chars = NULL;
+    row->capacity = 0;
+    row->length = 0;
+    row->gap = 0;
+    return row;
+}
+
+/* ---------- Row ops ---------- */
+
+static void editor_insert_row(int at, const char *s, size_t len) {
+    if (at < 0 || at > E.buf->num_rows) return;
+    editor_update_row(editor_open_row(at), s, len);
+}
+
+// Insert a row that borrows s (which must outlive it) instead of copying.
+static void editor_insert_row_shared(int at, const char *s, size_t len) {
+    if (at < 0 || at > E.buf->num_rows) return;
+    editor_row *row = editor_open_row(at);
+    row->chars = (char *)s;
+    row->length = len;
+}
+
+static void editor_row_insert_char(editor_row *row, int at, int c) {
+    editor_row_own(row);
+    if (at < 0 || at > (int)row->length) at = (int)row->length;
+    row_gap_reserve(row, 1);
+    row_gap_move(row, (size_t)at);
+    row->chars[row->gap++] = (char)c;
+    row->length++;
+    row_touch(row);
+}
+
+static void editor_row_insert_string(editor_row *row, size_t at, const char *s, size_t len) {
+    editor_row_own(row);
+    if (at > row->length) at = row->length;
+    row_gap_reserve(row, len);
+    row_gap_move(row, at);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->length += len;
+    row_touch(row);
+}
+
+static void editor_row_delete_char(editor_row *row, int at) {
+    if (at < 0 || at >= (int)row->length) return;
+    editor_row_own(row);
+    // backspacing right before the gap just widens it
+    if (row->gap == (size_t)at + 1) row->gap--;
+    else row_gap_move(row, (size_t)at);
+    row->length--;
+    row_touch(row);
+}
+
+static void editor_row_delete_range(editor_row *row, size_t at, size_t n) {
+    if (at >= row->length) return;
+    if (n > row->length - at) n = row->length - at;
+    editor_row_own(row);
+    row_gap_move(row, at + n);
+    row->gap -= n;
+    row->length -= n;
+    row_touch(row);
+}
+
+static void editor_row_append_string(editor_row *row, const char *s, size_t len) {
+    editor_row_own(row);
+    row_gap_reserve(row, len);
+    row_gap_move(row, row->length);
+    if (len) memcpy(&row->chars[row->gap], s, len);     // s may be NULL for an empty row
+    row->gap += len;
+    row->length += len;
+    row_touch(row);
+}
+
+/* ---------- Editor ops ---------- */
+
+// Edits are refused up front in follow mode, before anything is logged.
+static bool read_only_refused(void) {
+    if (E.buf->read_only) set_status_message("Read-only (follow mode)");
+    return E.buf->read_only;
+}
+
+static void editor_insert_char(int c) {
+    int cont = 0;
+    if (read_only_refused()) return;
+    // Safety: ensure there is at least one row to type into
+    if (E.buf->num_rows == 0) {
+        undo_record(UNDO_INSERT, 0, 0, 0, "\n", 1);
+        cont = UNDO_CONT;
+        editor_insert_row(0, "", 0);
+    }
+    if (E.buf->cursor_y == E.buf->num_rows) {
+        undo_record(UNDO_INSERT, cont, E.buf->num_rows, 0, "\n", 1);
+        cont = UNDO_CONT;
+        editor_insert_row(E.buf->num_rows, "", 0);
+    }
+    char ch = (char)c;
+    undo_record(UNDO_INSERT, cont | UNDO_TYPING, E.buf->cursor_y, (size_t)E.buf->cursor_x, &ch, 1);
+    editor_row_insert_char(row_at(E.buf->cursor_y), E.buf->cursor_x, c);
+    E.buf->cursor_x++;
+}
+
+// Fixed: handles empty buffer, end-of-buffer, and split line safely
+static void editor_insert_newline(void) {
+    if (read_only_refused()) return;
+    // Case 1: completely empty file → first row, then a new empty row below
+    if (E.buf->num_rows == 0) {
+        undo_record(UNDO_INSERT, 0, 0, 0, "\n\n", 2);
+        editor_insert_row(0, "", 0);
+        editor_insert_row(1, "", 0);
+        E.buf->cursor_y = 1;
+        E.buf->cursor_x = 0;
+        return;
+    }
+
+    // Case 2: cursor is below last row → append a new blank line
+    if (E.buf->cursor_y >= E.buf->num_rows) {
+        undo_record(UNDO_INSERT, 0, E.buf->num_rows, 0, "\n", 1);
+        editor_insert_row(E.buf->num_rows, "", 0);
+        E.buf->cursor_y = E.buf->num_rows - 1; // newly created is last
+        E.buf->cursor_x = 0;
+        return;
+    }
+
+    undo_record(UNDO_INSERT, 0, E.buf->cursor_y, (size_t)E.buf->cursor_x, "\n", 1);
+
+    // Case 3: at start of current line → insert blank line above
+    if (E.buf->cursor_x == 0) {
+        editor_insert_row(E.buf->cursor_y, "", 0);
+        E.buf->cursor_y++;
+        E.buf->cursor_x = 0;
+        return;
+    }
+
+    // Case 4: split current line at cursor
+    editor_row *row = row_at(E.buf->cursor_y);
+    size_t tail_len = row->length - (size_t)E.buf->cursor_x;
+
+    if (row->capacity == 0) {
+        // borrowed from the mapping: both halves keep pointing into it
+        editor_insert_row_shared(E.buf->cursor_y + 1, &row->chars[E.buf->cursor_x], tail_len);
+        row_at(E.buf->cursor_y)->length = (size_t)E.buf->cursor_x;
+    } else {
+        // with the gap at the cursor the tail is contiguous after it
+        row_gap_move(row, (size_t)E.buf->cursor_x);
+        const char *tail = row->chars + row->capacity - tail_len;
+        editor_insert_row(E.buf->cursor_y + 1, tail, tail_len);  // insert new row with tail
+        // reacquire row pointer in case the insert moved it; dropping the
+        // tail just extends the gap to the end of the buffer
+        row = row_at(E.buf->cursor_y);
+        row->length = (size_t)E.buf->cursor_x;
+    }
+
+    E.buf->cursor_y++;
+    E.buf->cursor_x = 0;
+}
+
+// With lf_only only '\n' ends a line (text replayed from the undo log).
+static const char *find_line_break(const char *s, const char *end, bool lf_only) {
+    if (lf_only) return memchr(s, '\n', (size_t)(end - s));
+    for (; s < end; s++) if (*s == '\n' || *s == '\r') return s;
+    return NULL;
+}
+
+static const char *skip_line_break(const char *s, const char *end) {
+    if (*s == '\r' && s + 1 < end && s[1] == '\n') return s + 2;
+    return s + 1;
+}
+
+// Insert a block of text at (y, x) of an existing row and leave the cursor
+// at its end. Line breaks become rows directly.
+static void insert_text_at(int y, size_t x, const char *s, size_t n, bool lf_only) {
+    const char *end = s + n;
+    const char *brk = find_line_break(s, end, lf_only);
+    editor_row *row = row_at(y);
+    if (x > row->length) x = row->length;
+    if (!brk) {
+        editor_row_insert_string(row, x, s, n);
+        E.buf->cursor_y = y;
+        E.buf->cursor_x = (int)(x + n);
+        return;
+    }
+
+    // cut the text after the cursor; it goes at the end of the last line
+    editor_row_own(row);
+    row_gap_move(row, x);
+    size_t tail_len = row->length - x;
+    char *tail = malloc(tail_len + 1);
+    if (!tail) die("malloc");
+    memcpy(tail, row->chars + row->capacity - tail_len, tail_len);
+    row->length = x;
+
+    editor_row_append_string(row, s, (size_t)(brk - s));
+    s = skip_line_break(brk, end);
+    while ((brk = find_line_break(s, end, lf_only)) != NULL) {
+        editor_insert_row(++y, s, (size_t)(brk - s));
+        s = skip_line_break(brk, end);
+    }
+    editor_insert_row(++y, s, (size_t)(end - s));
+    editor_row_append_string(row_at(y), tail, tail_len);
+    free(tail);
+    E.buf->cursor_y = y;
+    E.buf->cursor_x = (int)(end - s);
+}
+
+// Insert a block of text at the cursor in one go (used for pastes). Line
+// breaks (\n, \r\n or \r) become rows directly instead of feeding every
+// byte through editor_insert_char() / editor_insert_newline().
+static void editor_insert_text(const char *s, size_t n) {
+    int cont = 0;
+    if (!n || read_only_refused()) return;
+    if (E.buf->num_rows == 0) {
+        undo_record(UNDO_INSERT, 0, 0, 0, "\n", 1);
+        cont = UNDO_CONT;
+        editor_insert_row(0, "", 0);
+    }
+    if (E.buf->cursor_y >= E.buf->num_rows) {
+        undo_record(UNDO_INSERT, cont, E.buf->num_rows, 0, "\n", 1);
+        cont = UNDO_CONT;
+        editor_insert_row(E.buf->num_rows, "", 0);
+        E.buf->cursor_y = E.buf->num_rows - 1;
+        E.buf->cursor_x = 0;
+    }
+    undo_record_paste(cont, E.buf->cursor_y, (size_t)E.buf->cursor_x, s, n);
+    insert_text_at(E.buf->cursor_y, (size_t)E.buf->cursor_x, s, n, false);
+}
+
+static void editor_delete_char(void) {
+    if (read_only_refused()) return;
+    if (E.buf->num_rows == 0) return;
+    if (E.buf->cursor_y >= E.buf->num_rows) return;
+    if (E.buf->cursor_x == 0 && E.buf->cursor_y == 0) return;
+
+    editor_row *row = row_at(E.buf->cursor_y);
+    if (E.buf->cursor_x > 0) {
+        // the whole character before the cursor goes
+        size_t at = row_prev_char(row, (size_t)E.buf->cursor_x), n = (size_t)E.buf->cursor_x - at;
+        char c[4];
+        for (size_t i = 0; i < n; i++) c[i] = row_char(row, at + i);
+        undo_record(UNDO_DELETE, UNDO_BACKSPACE, E.buf->cursor_y, at, c, n);
+        if (n == 1) editor_row_delete_char(row, (int)at);
+        else editor_row_delete_range(row, at, n);
+        E.buf->cursor_x = (int)at;
+    } else {
+        // merge with previous line
+        int prev = E.buf->cursor_y - 1;
+        editor_row *prow = row_at(prev);
+        int prev_len = (int)prow->length;
+        undo_record(UNDO_DELETE, UNDO_BACKSPACE, prev, (size_t)prev_len, "\n", 1);
+        editor_row_append_string(prow, row_text(row), row->length);
+        editor_delete_row(E.buf->cursor_y);
+        E.buf->cursor_y = prev;
+        E.buf->cursor_x = prev_len;
+    }
+}
+
+/* ---------- Undo ---------- */
+
+/* Edits are logged as text inserted or deleted at (y, x), reading the
+ * buffer as rows that each end in '\n' (so y == num_rows is the very
+ * end). Records sit back to back in a fixed ring of UNDO_BYTES:
+ * a header, the text, and the record size again so undo can walk
+ * backwards. [head, cur) can be undone and [cur, tail) redone; a new
+ * edit drops the redo side, and when the ring is full the oldest steps
+ * fall off. Offsets only grow and are taken modulo the ring size. */
+
+struct undo_hdr {
+    uint8_t type, flags;
+    int y;
+    size_t x, len;
+};
+
+static void undo_put(size_t pos, const void *src, size_t n) {
+    const char *s = src;
+    while (n) {
+        size_t off = pos % UNDO_BYTES, k = UNDO_BYTES - off;
+        if (k > n) k = n;
+        memcpy(E.buf->undo.ring + off, s, k);
+        pos += k; s += k; n -= k;
+    }
+}
+
+static void undo_get(size_t pos, void *dst, size_t n) {
+    char *d = dst;
+    while (n) {
+        size_t off = pos % UNDO_BYTES, k = UNDO_BYTES - off;
+        if (k > n) k = n;
+        memcpy(d, E.buf->undo.ring + off, k);
+        pos += k; d += k; n -= k;
+    }
+}
+
+// Backspaced text is stored last character first, so a run can grow at
+// the end of its record.
+static void undo_put_text(size_t pos, const char *s, size_t n, int flags) {
+    if (!(flags & UNDO_BACKSPACE)) { undo_put(pos, s, n); return; }
+    for (size_t i = 0; i < n; i++) undo_put(pos + i, &s[n - 1 - i], 1);
+}
+
+static size_t undo_size(const struct undo_hdr *h) {
+    return sizeof *h + h->len + sizeof(uint32_t);
+}
+
+// Forget the oldest step, including the records that continue it.
+static void undo_drop(void) {
+    struct undo_log *u = &E.buf->undo;
+    struct undo_hdr h;
+    do {
+        undo_get(u->head, &h, sizeof h);
+        u->head += undo_size(&h);
+        if (u->head == u->cur) return;
+        undo_get(u->head, &h, sizeof h);
+    } while (h.flags & UNDO_CONT);
+}
+
+// Grow the last record by one typed or backspaced character if it is the
+// one right next to it.
+static bool undo_extend(int type, int flags, int y, size_t x, const char *s, size_t n) {
+    struct undo_log *u = &E.buf->undo;
+    if (u->cur == u->head || u->tail + n - u->head > UNDO_BYTES) return false;
+    uint32_t size;
+    undo_get(u->tail - sizeof size, &size, sizeof size);
+    size_t start = u->tail - size;
+    struct undo_hdr h;
+    undo_get(start, &h, sizeof h);
+    if (h.type != type || !(h.flags & flags) || h.y != y) return false;
+    if (flags == UNDO_TYPING ? x != h.x + h.len : x + n != h.x) return false;
+    if (flags == UNDO_BACKSPACE) h.x -= n;
+    undo_put_text(start + sizeof h + h.len, s, n, flags);
+    h.len += n;
+    undo_put(start, &h, sizeof h);
+    size += (uint32_t)n;
+    undo_put(start + size - sizeof size, &size, sizeof size);
+    u->tail = u->cur = start + size;
+    return true;
+}
+
+static void undo_record(int type, int flags, int y, size_t x, const char *s, size_t n) {
+    struct undo_log *u = &E.buf->undo;
+    if (u->applying || !n) return;
+    journal_record(type, y, x, s, n);
+    if (!u->ring && !(u->ring = malloc(UNDO_BYTES))) die("malloc");
+    u->tail = u->cur;
+    if (n <= 4 && (flags == UNDO_TYPING || flags == UNDO_BACKSPACE) &&
+        undo_extend(type, flags, y, x, s, n))
+        return;
+
+    struct undo_hdr h = { (uint8_t)type, (uint8_t)flags, y, x, n };
+    size_t size = undo_size(&h);
+    if (size > UNDO_BYTES) {        // too big to keep: start over
+        u->head = u->cur = u->tail;
+        return;
+    }
+    while (u->tail + size - u->head > UNDO_BYTES) undo_drop();
+    uint32_t size32 = (uint32_t)size;
+    undo_put(u->tail, &h, sizeof h);
+    undo_put_text(u->tail + sizeof h, s, n, flags);
+    undo_put(u->tail + size - sizeof size32, &size32, sizeof size32);
+    u->tail = u->cur = u->tail + size;
+}
+
+// Log a paste the way it ends up in the rows: \r\n and \r become \n.
+static void undo_record_paste(int flags, int y, size_t x, const char *s, size_t n) {
+    char *t = malloc(n);
+    if (!t) die("malloc");
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '\r') {
+            if (i + 1 < n && s[i + 1] == '\n') i++;
+            t[len++] = '\n';
+        } else {
+            t[len++] = s[i];
+        }
+    }
+    undo_record(UNDO_INSERT, flags, y, x, t, len);
+    free(t);
+}
+
+// Read the record at `start`; the caller frees *text.
+static size_t undo_load(size_t start, struct undo_hdr *h, char **text) {
+    undo_get(start, h, sizeof *h);
+    if (!(*text = malloc(h->len))) die("malloc");
+    undo_get(start + sizeof *h, *text, h->len);
+    if ((h->flags & UNDO_BACKSPACE) && h->len > 1) {
+        for (size_t i = 0, j = h->len - 1; i < j; i++, j--) {
+            char c = (*text)[i]; (*text)[i] = (*text)[j]; (*text)[j] = c;
+        }
+    }
+    return undo_size(h);
+}
+
+// Put text back at (y, x); the cursor ends up after it.
+static void edit_insert(int y, size_t x, const char *s, size_t n) {
+    journal_record(UNDO_INSERT, y, x, s, n);
+    if (y < E.buf->num_rows) {
+        insert_text_at(y, x, s, n, true);
+        return;
+    }
+    // past the last row every line becomes a row of its own
+    const char *end = s + n, *nl;
+    while (s < end) {
+        nl = memchr(s, '\n', (size_t)(end - s));
+        if (!nl) nl = end;
+        editor_insert_row(E.buf->num_rows, s, (size_t)(nl - s));
+        s = nl + 1;
+    }
+    E.buf->cursor_y = E.buf->num_rows;
+    E.buf->cursor_x = 0;
+}
+
+// Remove the n bytes of text s at (y, x), joining rows where a '\n' goes.
+static void edit_delete(int y, size_t x, const char *s, size_t n) {
+    journal_record(UNDO_DELETE, y, x, s, n);
+    while (n && y < E.buf->num_rows) {
+        editor_row *row = row_at(y);
+        if (x > row->length) x = row->length;
+        size_t k = row->length - x;
+        if (n <= k) {
+            editor_row_delete_range(row, x, n);
+            break;
+        }
+        editor_row_delete_range(row, x, k);
+        n -= k + 1;
+        if (y + 1 < E.buf->num_rows) {
+            editor_row *next = row_at(y + 1);
+            editor_row_append_string(row_at(y), row_text(next), next->length);
+            editor_delete_row(y + 1);
+        } else {
+            if (x == 0) editor_delete_row(y);
+            break;
+        }
+    }
+    E.buf->cursor_y = y;
+    E.buf->cursor_x = (int)x;
+}
+
+static void editor_undo(void) {
+    struct undo_log *u = &E.buf->undo;
+    if (read_only_refused()) return;
+    if (u->cur == u->head) { set_status_message("Nothing to undo"); return; }
+    struct undo_hdr h;
+    u->applying = true;
+    do {
+        uint32_t size;
+        char *text;
+        undo_get(u->cur - sizeof size, &size, sizeof size);
+        u->cur -= size;
+        undo_load(u->cur, &h, &text);
+        if (h.type == UNDO_INSERT) {
+            edit_delete(h.y, h.x, text, h.len);
+        } else {
+            edit_insert(h.y, h.x, text, h.len);
+            // backspacing leaves the cursor after the text, deleting before it
+            if (!(h.flags & UNDO_BACKSPACE)) { E.buf->cursor_y = h.y; E.buf->cursor_x = (int)h.x; }
+        }
+        free(text);
+    } while ((h.flags & UNDO_CONT) && u->cur != u->head);
+    u->applying = false;
+}
+
+static void editor_redo(void) {
+    struct undo_log *u = &E.buf->undo;
+    if (read_only_refused()) return;
+    if (u->cur == u->tail) { set_status_message("Nothing to redo"); return; }
+    struct undo_hdr h;
+    u->applying = true;
+    do {
+        char *text;
+        u->cur += undo_load(u->cur, &h, &text);
+        if (h.type == UNDO_INSERT) edit_insert(h.y, h.x, text, h.len);
+        else edit_delete(h.y, h.x, text, h.len);
+        free(text);
+        if (u->cur != u->tail) undo_get(u->cur, &h, sizeof h);
+    } while (u->cur != u->tail && (h.flags & UNDO_CONT));
+    u->applying = false;
+}
+
+/* ---------- File I/O ---------- */
+
+/* A background thread scans the mapping for newlines and publishes a
+ * sparse checkpoint every INDEX_CHECKPOINT_LINES lines (the first one
+ * after a single block, so the first screen appears almost at once). The
+ * main thread turns each checkpoint into a span block; rows are only
+ * built for the blocks that are actually looked at. */
+
+struct index_cut { size_t end; int lines; };    // span ends at byte `end`
+
+struct line_index {
+    const char *data;
+    size_t size;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct index_cut *cuts;     // published checkpoints, guarded by lock
+    size_t ncuts, cap;
+    bool done;                  // guarded by lock
+    bool notified;              // a wakeup is pending in the pipe
+    int pipe[2];
+    size_t taken;               // main thread: cuts already turned into blocks
+    size_t loaded_end;          // main thread: bytes covered by those blocks
+};
+
+static void cuts_push(struct index_cut **cuts, size_t *n, size_t *cap, size_t end, int lines) {
+    if (*n == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 64;
+        struct index_cut *c = realloc(*cuts, sizeof(*c) * ncap);
+        if (!c) die("realloc");
+        *cuts = c; *cap = ncap;
+    }
+    (*cuts)[*n].end = end;
+    (*cuts)[*n].lines = lines;
+    (*n)++;
+}
+
+static void index_publish(struct line_index *ix, size_t end, int lines, bool done) {
+    pthread_mutex_lock(&ix->lock);
+    if (lines) cuts_push(&ix->cuts, &ix->ncuts, &ix->cap, end, lines);
+    ix->done = done;
+    bool wake = !ix->notified;
+    ix->notified = true;
+    pthread_mutex_unlock(&ix->lock);
+    if (wake && write(ix->pipe[1], "i", 1) < 0) { /* the wakeup is best effort */ }
+}
+
+/* Big files are split at line boundaries into one chunk per thread. The
+ * first chunk is published as it is scanned; the others collect their
+ * checkpoints privately and are stitched on in order as they finish. */
+struct index_chunk {
+    struct line_index *ix;
+    const char *start, *end;
+    pthread_t thread;
+    bool threaded;
+    struct index_cut *cuts;     // private checkpoints, or NULL when publishing live
+    size_t ncuts, cap;
+};
+
+static void index_scan(struct index_chunk *c, bool live) {
+    const char *data = c->ix->data, *p = c->start;
+    int limit = live ? ROW_BLOCK_SIZE : INDEX_CHECKPOINT_LINES;
+    while (p < c->end) {
+        int lines;
+        bool cr = false;
+        const char *q = newline_scan(p, c->end, limit, &lines, &cr);
+        if (q == c->end && c->end[-1] != '\n') lines++;     // unterminated last line
+        if (live) index_publish(c->ix, (size_t)(q - data), lines, false);
+        else cuts_push(&c->cuts, &c->ncuts, &c->cap, (size_t)(q - data), lines);
+        p = q;
+        limit = INDEX_CHECKPOINT_LINES;
+    }
+}
+
+static void *index_chunk_worker(void *arg) {
+    index_scan(arg, false);
+    return NULL;
+}
+
+static int index_threads(size_t size) {
+    if (size < INDEX_PARALLEL_MIN) return 1;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    return n > INDEX_THREADS ? INDEX_THREADS : (int)n;
+}
+
+static void *index_worker(void *arg) {
+    struct line_index *ix = arg;
+    const char *end = ix->data + ix->size;
+    struct index_chunk chunks[INDEX_THREADS];
+    int k = index_threads(ix->size);
+
+    const char *p = ix->data;
+    for (int i = 0; i < k; i++) {
+        const char *cut = end;
+        if (i < k - 1) {
+            const char *mid = ix->data + ix->size / (size_t)k * (size_t)(i + 1);
+            const char *nl = mid > p ? memchr(mid, '\n', (size_t)(end - mid)) : NULL;
+            cut = nl ? nl + 1 : (mid > p ? end : p);
+        }
+        chunks[i] = (struct index_chunk){ .ix = ix, .start = p, .end = cut };
+        if (i > 0)
+            chunks[i].threaded = pthread_create(&chunks[i].thread, NULL,
+                                                index_chunk_worker, &chunks[i]) == 0;
+        p = cut;
+    }
+
+    index_scan(&chunks[0], true);
+    for (int i = 1; i < k; i++) {
+        struct index_chunk *c = &chunks[i];
+        if (c->threaded) pthread_join(c->thread, NULL);
+        else index_scan(c, false);
+        for (size_t j = 0; j < c->ncuts; j++)
+            index_publish(ix, c->cuts[j].end, c->cuts[j].lines, false);
+        free(c->cuts);
+    }
+    index_publish(ix, ix->size, 0, true);
+    return NULL;
+}
+
+// The first line of a file decides how saved lines end.
+static void note_line_end(const char *p, size_t len) {
+    if (E.buf->num_rows) return;
+    const char *nl = memchr(p, '\n', len);
+    E.buf->crlf = nl && nl > p && nl[-1] == '\r';
+}
+
+static void on_index_pipe(int fd);
+
+static void index_start(const char *data, size_t size) {
+    struct line_index *ix = calloc(1, sizeof(*ix));
+    if (!ix) die("calloc");
+    ix->data = data;
+    ix->size = size;
+    pthread_mutex_init(&ix->lock, NULL);
+    if (pipe(ix->pipe) == -1) die("pipe");
+    fcntl(ix->pipe[0], F_SETFL, fcntl(ix->pipe[0], F_GETFL) | O_NONBLOCK);
+    if (pthread_create(&ix->thread, NULL, index_worker, ix) != 0) die("pthread_create");
+    E.buf->index = ix;
+    // with every spare watch taken (many buffers indexing at once) this
+    // one is indexed to the end right here; the reserved ones stay free
+    // for the subsystems that watch a single pipe each
+    bool wait_all = num_watches >= MAX_WATCHES - RESERVED_WATCHES;
+    if (!wait_all) event_watch_fd(ix->pipe[0], on_index_pipe);
+
+    // wait for the first block so the file never shows up empty
+    struct pollfd pfd = { .fd = ix->pipe[0], .events = POLLIN };
+    do {
+        while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {}
+        on_index_pipe(pfd.fd);
+    } while (wait_all && E.buf->index);
+}
+
+// Append the newly published checkpoints as span blocks.
+static void index_take(void) {
+    struct line_index *ix = E.buf->index;
+
+    pthread_mutex_lock(&ix->lock);
+    ix->notified = false;
+    bool done = ix->done;
+    bool stick = E.buf->read_only && E.buf->cursor_y >= E.buf->num_rows - 1;
+    for (; ix->taken < ix->ncuts; ix->taken++) {
+        const struct index_cut *cut = &ix->cuts[ix->taken];
+        const char *span = ix->data + ix->loaded_end;
+        size_t len = cut->end - ix->loaded_end;
+        note_line_end(span, len);
+        row_table_append_span(span, len, cut->lines);
+        ix->loaded_end = cut->end;
+    }
+    pthread_mutex_unlock(&ix->lock);
+    // a follower at the last line stays there as lines come in
+    if (stick && E.buf->num_rows) { E.buf->cursor_y = E.buf->num_rows - 1; E.buf->cursor_x = 0; }
+
+    if (done) {
+        pthread_join(ix->thread, NULL);
+        event_unwatch_fd(ix->pipe[0]);
+        close(ix->pipe[0]);
+        close(ix->pipe[1]);
+        pthread_mutex_destroy(&ix->lock);
+        free(ix->cuts);
+        free(ix);
+        E.buf->index = NULL;
+        follow_check();     // catch up with changes made meanwhile
+    }
+}
+
+static void search_resolve(void);
+
+static void on_index_pipe(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+    struct editor_buffer *cur = E.buf;
+    for (int i = 0; i < E.num_buffers; i++) {
+        E.buf = E.buffers[i];
+        if (E.buf->index && E.buf->index->pipe[0] == fd) index_take();
+    }
+    E.buf = cur;
+    search_resolve();
+    request_redraw();
+}
+
+/* Pipes and other input that can not be mapped are read from the event
+ * loop as the data arrives, so the first screen shows up long before EOF.
+ * The text goes into arena chunks; complete lines are appended as span
+ * blocks borrowing from the chunk, and an unfinished line is carried over
+ * to the next chunk when the current one fills up. */
+
+static struct {
+    int fd;             // input still being read, or -1
+    struct editor_buffer *dest; // the buffer it goes into
+    char *buf;          // current chunk
+    size_t cap, used;
+    size_t start;       // first byte not yet handed to the row table
+} stream = { .fd = -1 };
+
+// Start a new chunk, moving the unfinished line over to it.
+static void stream_grow(void) {
+    size_t rest = stream.used - stream.start;
+    size_t cap = ARENA_SLAB_SIZE;
+    while (cap < rest * 2) cap *= 2;
+    char *buf = arena_bump(cap, 1);
+    if (rest) memcpy(buf, stream.buf + stream.start, rest);
+    stream.buf = buf;
+    stream.cap = cap;
+    stream.used = rest;
+    stream.start = 0;
+}
+
+// Hand the complete lines read so far to the row table; `from` is where
+// the new bytes begin. At EOF an unterminated last line goes too.
+static void stream_flush(size_t from, bool eof) {
+    const char *p = stream.buf + stream.start, *end = stream.buf + stream.used;
+    const char *q = end;
+    if (!eof) {
+        const char *lo = stream.buf + from;
+        while (q > lo && q[-1] != '\n') q--;
+        if (q == lo) return;
+    }
+    if (q == p) return;
+    int lines;
+    bool cr = false;
+    newline_scan(p, q, INT_MAX, &lines, &cr);
+    if (q[-1] != '\n') lines++;
+    note_line_end(p, (size_t)(q - p));
+    row_table_append_span(p, (size_t)(q - p), lines);
+    stream.start = (size_t)(q - stream.buf);
+}
+
+static void on_stream_data(int fd) {
+    struct editor_buffer *cur = E.buf;
+    E.buf = stream.dest;
+    // read at most a slab per wakeup so keys and redraws still get through
+    size_t budget = ARENA_SLAB_SIZE;
+    while (budget) {
+        if (stream.used == stream.cap) stream_grow();
+        size_t from = stream.used;
+        ssize_t n = read(fd, stream.buf + stream.used, stream.cap - stream.used);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) break;
+        if (n <= 0) {
+            if (n == -1) set_status_message("Read error: %s", strerror(errno));
+            stream_flush(from, true);
+            event_unwatch_fd(fd);
+            close(fd);
+            stream.fd = -1;
+            break;
+        }
+        stream.used += (size_t)n;
+        budget -= (size_t)n < budget ? (size_t)n : budget;
+        stream_flush(from, false);
+    }
+    E.buf = cur;
+    request_redraw();
+}
+
+// One input is read at a time; returns false when another one still is.
+static bool stream_start(int fd) {
+    if (stream.fd >= 0) {
+        set_status_message("Still reading %s", stream.dest->filename[0] ? stream.dest->filename : "input");
+        close(fd);
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    stream.fd = fd;
+    stream.dest = E.buf;
+    event_watch_fd(fd, on_stream_data);
+    return true;
+}
+
+/* A mapped file that is cut short under us (logrotate's copytruncate)
+ * raises SIGBUS on the first read past its new end, from whichever thread
+ * reads it. The handler maps zero pages over the rest of that mapping, so
+ * the read goes on and sees NUL bytes, and tells the main loop, which
+ * marks the buffers showing it. Mappings are registered in a fixed table
+ * the handler can walk without locks; a SIGBUS anywhere else is fatal as
+ * before. */
+#define MAX_BUS_MAPS 1024
+
+static struct bus_map {
+    char *start;                // NULL for a free slot
+    size_t size;
+    struct editor_buffer *owner;    // NULL: every buffer showing the map
+    volatile sig_atomic_t shrunk;
+} bus_maps[MAX_BUS_MAPS];
+static size_t page_size;
+static int zero_fd = -1;        // /dev/zero, opened up front for the handler
+
+static void bus_map_add(char *m, size_t size, struct editor_buffer *owner) {
+    for (int i = 0; i < MAX_BUS_MAPS; i++) {
+        if (__atomic_load_n(&bus_maps[i].start, __ATOMIC_ACQUIRE)) continue;
+        bus_maps[i].size = size;
+        bus_maps[i].owner = owner;
+        bus_maps[i].shrunk = 0;
+        __atomic_store_n(&bus_maps[i].start, m, __ATOMIC_RELEASE);
+        return;
+    }
+}
+
+static void bus_map_remove(const char *m) {
+    for (int i = 0; i < MAX_BUS_MAPS; i++)
+        if (bus_maps[i].start == m) __atomic_store_n(&bus_maps[i].start, NULL, __ATOMIC_RELEASE);
+}
+
+static void on_bus(int sig, siginfo_t *si, void *ctx) {
+    (void)ctx;
+    char *a = si->si_addr;
+    for (int i = 0; i < MAX_BUS_MAPS; i++) {
+        char *m = __atomic_load_n(&bus_maps[i].start, __ATOMIC_ACQUIRE);
+        if (!m || a < m || a >= m + bus_maps[i].size) continue;
+        char *from = m + ((size_t)(a - m) & ~(page_size - 1));
+        if (mmap(from, (size_t)(m + bus_maps[i].size - from), PROT_READ,
+                 MAP_PRIVATE | MAP_FIXED, zero_fd, 0) == MAP_FAILED) break;
+        bus_maps[i].shrunk = 1;
+        ned_map_shrunk = 1;
+        on_winch(sig);
+        return;
+    }
+    signal(SIGBUS, SIG_DFL);    // not ours: the retried read kills us
+}
+
+// Main loop side: mark the buffers whose file was cut short.
+static void bus_maps_check(void) {
+    ned_map_shrunk = 0;
+    for (int i = 0; i < MAX_BUS_MAPS; i++) {
+        char *m = __atomic_load_n(&bus_maps[i].start, __ATOMIC_ACQUIRE);
+        if (!m || !bus_maps[i].shrunk) continue;
+        bus_maps[i].shrunk = 0;
+        for (int b = 0; b < E.num_buffers; b++) {
+            struct editor_buffer *buf = E.buffers[b];
+            if (bus_maps[i].owner ? buf != bus_maps[i].owner : buf->map != m) continue;
+            buf->changed_on_disk = true;
+            set_status_message("%s was cut short on disk; text past its new end reads as NUL bytes",
+                               buf->filename);
+        }
+    }
+    request_redraw();
+}
+
+static void bus_init(void) {
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    zero_fd = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+    if (zero_fd == -1) return;      // no handler: a shrunk file kills us as it always did
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_bus;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+/* A file open in several buffers is mapped once. The entry is keyed by
+ * the identity of the file, so a file replaced on disk (by a save, say)
+ * gets a mapping of its own. Mappings are kept until exit like the one of
+ * a single buffer; each buffer still indexes the file for its own rows. */
+static struct file_map {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *map;
+} *file_maps;
+static int num_file_maps;
+
+static char *file_map_get(int fd, const struct stat *st) {
+    for (int i = 0; i < num_file_maps; i++) {
+        struct file_map *f = &file_maps[i];
+        if (f->dev == st->st_dev && f->ino == st->st_ino && f->size == st->st_size &&
+            f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec)
+            return f->map;
+    }
+    void *m = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) return NULL;
+    bus_map_add(m, (size_t)st->st_size, NULL);
+    struct file_map *f = realloc(file_maps, sizeof(*f) * (size_t)(num_file_maps + 1));
+    if (!f) die("realloc");
+    file_maps = f;
+    file_maps[num_file_maps++] = (struct file_map){ st->st_dev, st->st_ino, st->st_size, st->st_mtim, m };
+    return m;
+}
+
+// Drop the entry of a mapping about to be unmapped.
+static void file_map_forget(const char *map) {
+    for (int i = 0; i < num_file_maps; i++) {
+        if (file_maps[i].map != map) continue;
+        bus_map_remove(map);
+        file_maps[i] = file_maps[--num_file_maps];
+        return;
+    }
+}
+
+static void load_file(const char *path) {
+    if (path) {
+        strncpy(E.buf->filename, path, MAX_FILENAME - 1);
+        E.buf->filename[MAX_FILENAME - 1] = '\0';
+    } else {
+        E.buf->filename[0] = '\0';
+    }
+    hl_select();
+
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if (fd == -1) {
+        set_status_message("New file: %s", E.buf->filename[0] ? E.buf->filename : "(unnamed)");
+        return;
+    }
+
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    char *m = regular && st.st_size > 0 ? file_map_get(fd, &st) : NULL;
+    if (regular && (m || st.st_size == 0)) {
+        close(fd);
+        if (m) {
+            E.buf->map = m;
+            E.buf->map_size = (size_t)st.st_size;
+            index_start(E.buf->map, E.buf->map_size);
+        }
+        E.buf->modified = false;
+        set_status_message("Opened: %s", E.buf->filename);
+        return;
+    }
+
+    // Not mappable (pipe, device, ...): read it as it comes
+    if (!stream_start(fd)) return;
+    E.buf->modified = false;
+    set_status_message("Opened: %s", E.buf->filename);
+}
+
+static void open_file(const char *path) {
+    load_file(path);
+    journal_open();
+}
+
+/* Saving runs on a worker thread so editing continues meanwhile. The main
+ * thread takes a snapshot of the rows as an iovec list: rows borrowed from
+ * the mapping are referenced in place (the mapping never changes), edited
+ * rows are copied into chunks owned by the job. The worker writev()s the
+ * list into a temp file next to the target, fsyncs it and renames it over
+ * the original, so a crash mid-save never leaves a truncated file. The
+ * old inode stays alive as long as it is mapped, so borrowed rows remain
+ * valid after the rename. */
+
+#define SAVE_IOVECS 1024    // iovecs per writev() (IOV_MAX on Linux)
+
+struct save_chunk {
+    struct save_chunk *next;
+    size_t used, cap;
+    char data[];
+};
+
+struct save_job {
+    struct editor_buffer *buf;  // the buffer being saved
+    char target[PATH_MAX];
+    char tmp[PATH_MAX + 16];
+    int fd;
+    struct iovec *iov;
+    size_t n, cap;
+    struct save_chunk *chunks;
+    size_t total;               // bytes to write
+    size_t written;             // progress, guarded by save_lock
+    int err;
+    unsigned long change_count; // E.buf->change_count at snapshot time
+    size_t journal_mark;        // journal bytes covered by the snapshot
+    pthread_t thread;
+};
+
+static struct save_job *save_job;   // save in flight, or NULL
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static int save_pipe[2] = {-1, -1};
+static int save_timer = -1;
+
+// Queue len bytes at p; bytes that directly follow the previous run in
+// memory (untouched rows still back to back in the mapping, or copies
+// made back to back into a chunk) extend it.
+static void snap_add(struct save_job *job, const char *p, size_t len) {
+    if (!len) return;
+    job->total += len;
+    if (job->n) {
+        struct iovec *last = &job->iov[job->n - 1];
+        if ((const char *)last->iov_base + last->iov_len == p) { last->iov_len += len; return; }
+    }
+    if (job->n == job->cap) {
+        size_t cap = job->cap ? job->cap * 2 : 256;
+        struct iovec *v = realloc(job->iov, sizeof(struct iovec) * cap);
+        if (!v) die("realloc");
+        job->iov = v; job->cap = cap;
+    }
+    job->iov[job->n].iov_base = (void *)p;
+    job->iov[job->n].iov_len = len;
+    job->n++;
+}
+
+static void snap_copy(struct save_job *job, const char *p, size_t len) {
+    if (!len) return;
+    struct save_chunk *c = job->chunks;
+    if (!c || c->cap - c->used < len) {
+        size_t cap = len > (1 << 20) ? len : (1 << 20);
+        c = malloc(sizeof(struct save_chunk) + cap);
+        if (!c) die("malloc");
+        c->next = job->chunks;
+        c->used = 0;
+        c->cap = cap;
+        job->chunks = c;
+    }
+    memcpy(c->data + c->used, p, len);
+    snap_add(job, c->data + c->used, len);
+    c->used += len;
+}
+
+static const char *line_end(void) { return E.buf->crlf ? "\r\n" : "\n"; }
+
+static void snap_add_row(struct save_job *job, const editor_row *row) {
+    // a borrowed row followed by its own line end in the mapping goes out
+    // in place, line end included, so runs of unchanged lines coalesce
+    const char *eol = line_end();
+    size_t eol_len = strlen(eol);
+    if (row->capacity == 0 && E.buf->map && row->chars >= E.buf->map &&
+        row->chars + row->length + eol_len <= E.buf->map + E.buf->map_size &&
+        memcmp(row->chars + row->length, eol, eol_len) == 0) {
+        snap_add(job, row->chars, row->length + eol_len);
+        return;
+    }
+    const char *a, *b;
+    size_t alen, blen;
+    row_runs(row, &a, &alen, &b, &blen);
+    if (row->capacity == 0) {
+        snap_add(job, a, alen);
+        snap_copy(job, eol, eol_len);
+        return;
+    }
+    snap_copy(job, a, alen);
+    snap_copy(job, b, blen);
+    snap_copy(job, eol, eol_len);
+}
+
+// Unmaterialized text goes out straight from the mapping. Only the last
+// line of the file can lack a line end; it gets one like any other row.
+static void snap_add_span(struct save_job *job, const char *p, size_t len) {
+    snap_add(job, p, len);
+    if (len && p[len - 1] != '\n') snap_copy(job, line_end(), strlen(line_end()));
+}
+
+static void save_job_free(struct save_job *job) {
+    while (job->chunks) {
+        struct save_chunk *next = job->chunks->next;
+        free(job->chunks);
+        job->chunks = next;
+    }
+    free(job->iov);
+    free(job);
+}
+
+static void *save_worker(void *arg) {
+    struct save_job *job = arg;
+    struct iovec *v = job->iov;
+    size_t n = job->n;
+    while (n > 0) {
+        int cnt = n > SAVE_IOVECS ? SAVE_IOVECS : (int)n;
+        ssize_t r = writev(job->fd, v, cnt);
+        if (r < 0) { if (errno == EINTR) continue; job->err = errno; break; }
+        pthread_mutex_lock(&save_lock);
+        job->written += (size_t)r;
+        pthread_mutex_unlock(&save_lock);
+        while (n > 0 && (size_t)r >= v->iov_len) { r -= (ssize_t)v->iov_len; v++; n--; }
+        if (n > 0) { v->iov_base = (char *)v->iov_base + r; v->iov_len -= (size_t)r; }
+    }
+
+    if (!job->err && fsync(job->fd) == -1) job->err = errno;
+    if (close(job->fd) == -1 && !job->err) job->err = errno;
+    if (!job->err && rename(job->tmp, job->target) == -1) job->err = errno;
+    if (job->err) {
+        unlink(job->tmp);
+    } else {
+        // make the rename itself durable
+        char dir[PATH_MAX];
+        strcpy(dir, job->target);
+        char *slash = strrchr(dir, '/');
+        if (slash) *slash = '\0';
+        int dfd = open(slash ? (dir[0] ? dir : "/") : ".", O_RDONLY);
+        if (dfd != -1) { fsync(dfd); close(dfd); }
+    }
+    if (write(save_pipe[1], "s", 1) < 0) { /* the main loop will never hear back */ }
+    return NULL;
+}
+
+static void save_progress(void) {
+    pthread_mutex_lock(&save_lock);
+    size_t written = save_job ? save_job->written : 0;
+    size_t total = save_job ? save_job->total : 0;
+    pthread_mutex_unlock(&save_lock);
+    if (total)
+        set_status_message("Saving %s... %d%%", save_job->buf->filename, (int)(written * 100 / total));
+}
+
+static void save_finish(void) {
+    struct save_job *job = save_job;
+    pthread_join(job->thread, NULL);
+    save_job = NULL;
+    timer_stop(save_timer);
+    save_timer = -1;
+    struct editor_buffer *cur = E.buf;
+    E.buf = job->buf;
+    if (job->err) {
+        set_status_message("I/O error: %s", strerror(job->err));
+    } else {
+        // edits made while the worker ran are not in the file yet
+        if (E.buf->change_count == job->change_count) E.buf->modified = false;
+        set_status_message("Saved: %s", E.buf->filename);
+        journal_saved(job->journal_mark);
+    }
+    E.buf = cur;
+    save_job_free(job);
+}
+
+static void on_save_pipe(int fd) {
+    char buf[16];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+    if (save_job) save_finish();
+}
+
+// Block until an in-flight save is on disk (used before quitting).
+static void save_wait(void) {
+    if (save_job) save_finish();
+}
+
+static void save_file(void) {
+    if (read_only_refused()) return;
+    if (!E.buf->filename[0]) { set_status_message("ERROR: No filename"); return; }
+    if (save_job) { set_status_message("Save already in progress"); return; }
+
+    struct save_job *job = calloc(1, sizeof(*job));
+    if (!job) die("calloc");
+    job->buf = E.buf;
+    // write through symlinks like an in-place save would
+    if (!realpath(E.buf->filename, job->target)) {
+        strncpy(job->target, E.buf->filename, sizeof(job->target) - 1);
+        job->target[sizeof(job->target) - 1] = '\0';
+    }
+    snprintf(job->tmp, sizeof(job->tmp), "%s.nedXXXXXX", job->target);
+    job->fd = mkstemp(job->tmp);
+    if (job->fd == -1) {
+        set_status_message("I/O error: %s", strerror(errno));
+        save_job_free(job);
+        return;
+    }
+
+    struct stat st;
+    mode_t mode;
+    if (stat(job->target, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    fchmod(job->fd, mode);
+
+    for (int b = 0; b < E.buf->num_blocks; b++) {
+        if (E.buf->blocks[b].span) { snap_add_span(job, E.buf->blocks[b].span, E.buf->blocks[b].span_len); continue; }
+        for (int i = 0; i < E.buf->blocks[b].num_rows; i++) snap_add_row(job, &E.buf->blocks[b].rows[i]);
+    }
+    if (E.buf->index)    // the part the indexer has not reached yet
+        snap_add_span(job, E.buf->index->data + E.buf->index->loaded_end, E.buf->index->size - E.buf->index->loaded_end);
+    job->change_count = E.buf->change_count;
+    job->journal_mark = journal_mark();
+
+    if (save_pipe[0] == -1) {
+        if (pipe(save_pipe) == -1) die("pipe");
+        fcntl(save_pipe[0], F_SETFL, fcntl(save_pipe[0], F_GETFL) | O_NONBLOCK);
+        event_watch_fd(save_pipe[0], on_save_pipe);
+    }
+    save_job = job;
+    if (pthread_create(&job->thread, NULL, save_worker, job) != 0) {
+        save_job = NULL;
+        close(job->fd);
+        unlink(job->tmp);
+        save_job_free(job);
+        set_status_message("ERROR: cannot start save");
+        return;
+    }
+    set_status_message("Saving %s...", E.buf->filename);
+    save_timer = timer_start(SAVE_PROGRESS_MS, SAVE_PROGRESS_MS, save_progress);
+}
+
+/* ---------- Journal ---------- */
+
+/* Edits also go to <file>.ned-journal, in the undo record format (header,
+ * text, size), so the work of a session that dies is not lost. Records
+ * collect in memory and are written once the editor has been idle for
+ * JOURNAL_IDLE_MS (or JOURNAL_BATCH bytes have piled up) and fsynced at
+ * most every JOURNAL_FSYNC_MS, so the cost follows the edits and never the
+ * file size. The journal starts with the identity of the file it applies
+ * to; opening that file again replays it. Saving retires the records the
+ * file now has, and Ctrl-Q (quitting on purpose) deletes the journal. */
+
+#define JOURNAL_MAGIC "NEDJRNL1"
+
+static int journal_idle_timer = -1, journal_sync_timer = -1;
+
+static bool write_all(int fd, const void *p, size_t n) {
+    const char *s = p;
+    while (n) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        s += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+static void journal_identify(const char *path, struct journal_head *h) {
+    struct stat st;
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, JOURNAL_MAGIC, sizeof h->magic);
+    if (stat(path, &st) == -1) return;      // not saved yet
+    h->ino = (uint64_t)st.st_ino;
+    h->size = (uint64_t)st.st_size;
+    h->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    h->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+}
+
+// Stop journaling; with `discard` the journal file goes too.
+static void journal_close(bool discard) {
+    struct journal_log *j = &E.buf->journal;
+    j->len = 0;
+    j->unsynced = false;
+    if (j->fd < 0) return;
+    close(j->fd);
+    j->fd = -1;
+    if (discard) unlink(j->path);
+}
+
+static void journal_fail(void) {
+    set_status_message("Journal %s: %s", E.buf->journal.path, strerror(errno));
+    journal_close(false);
+    E.buf->journal.off = true;
+}
+
+static void journal_fsync(void) {
+    struct journal_log *j = &E.buf->journal;
+    if (j->fd >= 0 && fdatasync(j->fd) == -1) { journal_fail(); return; }
+    j->unsynced = false;
+    j->synced = now_ms();
+}
+
+// The timers serve every buffer, each in its own context.
+static void journal_on_sync(void) {
+    journal_sync_timer = -1;
+    struct editor_buffer *cur = E.buf;
+    for (int i = 0; i < E.num_buffers; i++) {
+        E.buf = E.buffers[i];
+        if (E.buf->journal.unsynced) journal_fsync();
+    }
+    E.buf = cur;
+}
+
+static void journal_flush(void) {
+    struct journal_log *j = &E.buf->journal;
+    if (j->fd < 0 || !j->len) return;
+    if (!write_all(j->fd, j->buf, j->len)) { journal_fail(); return; }
+    j->size += j->len;
+    j->len = 0;
+    j->unsynced = true;
+    long long wait = j->synced + JOURNAL_FSYNC_MS - now_ms();
+    if (wait <= 0) journal_fsync();
+    else if (journal_sync_timer < 0) journal_sync_timer = timer_start((int)wait, 0, journal_on_sync);
+}
+
+static void journal_on_idle(void) {
+    journal_idle_timer = -1;
+    struct editor_buffer *cur = E.buf;
+    for (int i = 0; i < E.num_buffers; i++) {
+        E.buf = E.buffers[i];
+        journal_flush();
+    }
+    E.buf = cur;
+}
+
+static void journal_append(const void *p, size_t n) {
+    struct journal_log *j = &E.buf->journal;
+    if (j->len + n > j->cap) {
+        size_t cap = j->cap ? j->cap : 4096;
+        while (cap < j->len + n) cap *= 2;
+        char *b = realloc(j->buf, cap);
+        if (!b) die("realloc");
+        j->buf = b;
+        j->cap = cap;
+    }
+    memcpy(j->buf + j->len, p, n);
+    j->len += n;
+}
+
+static void journal_record(int type, int y, size_t x, const char *s, size_t n) {
+    struct journal_log *j = &E.buf->journal;
+    if (j->off || j->replaying || !n) return;
+    if (j->fd < 0) {
+        j->fd = open(j->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (j->fd == -1 || !write_all(j->fd, &j->base, sizeof j->base)) {
+            journal_fail();
+            return;
+        }
+        j->size = sizeof j->base;
+        j->synced = 0;
+    }
+    struct undo_hdr h;
+    memset(&h, 0, sizeof h);
+    h.type = (uint8_t)type;
+    h.y = y;
+    h.x = x;
+    h.len = n;
+    uint32_t size = (uint32_t)undo_size(&h);
+    journal_append(&h, sizeof h);
+    journal_append(s, n);
+    journal_append(&size, sizeof size);
+    if (j->len >= JOURNAL_BATCH) {
+        journal_flush();
+    } else {
+        timer_stop(journal_idle_timer);
+        journal_idle_timer = timer_start(JOURNAL_IDLE_MS, 0, journal_on_idle);
+    }
+}
+
+// Replay the records of the journal in data[0, n) onto the buffer; a torn
+// record at the end (a crash mid-write) ends it. Returns the bytes used.
+static size_t journal_replay(const char *data, size_t n, int *count) {
+    size_t at = sizeof(struct journal_head);
+    E.buf->undo.applying = E.buf->journal.replaying = true;
+    while (n - at >= sizeof(struct undo_hdr) + sizeof(uint32_t)) {
+        struct undo_hdr h;
+        uint32_t size;
+        memcpy(&h, data + at, sizeof h);
+        if (h.len > n - at || undo_size(&h) > n - at) break;
+        memcpy(&size, data + at + undo_size(&h) - sizeof size, sizeof size);
+        if (size != undo_size(&h) || h.y < 0 || h.y > E.buf->num_rows) break;
+        const char *text = data + at + sizeof h;
+        if (h.type == UNDO_INSERT) edit_insert(h.y, h.x, text, h.len);
+        else edit_delete(h.y, h.x, text, h.len);
+        at += size;
+        (*count)++;
+    }
+    E.buf->undo.applying = E.buf->journal.replaying = false;
+    return at;
+}
+
+// Called once the file is opened: replay a journal left behind for it.
+static void journal_open(void) {
+    struct journal_log *j = &E.buf->journal;
+    journal_close(false);
+    struct stat st;
+    j->off = !E.buf->filename[0] || E.buf->read_only ||
+             (stat(E.buf->filename, &st) == 0 && !S_ISREG(st.st_mode));
+    if (j->off) return;
+    snprintf(j->path, sizeof(j->path), "%s.ned-journal", E.buf->filename);
+    for (int i = 0; i < E.num_buffers; i++) {
+        const struct journal_log *o = &E.buffers[i]->journal;
+        if (o == j || o->off || strcmp(o->path, j->path) != 0) continue;
+        // the same file in another buffer: that one keeps the journal
+        set_status_message("%s is open twice; this copy is not journaled", E.buf->filename);
+        j->off = true;
+        return;
+    }
+    journal_identify(E.buf->filename, &j->base);
+
+    int fd = open(j->path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return;
+    char *data = NULL;
+    size_t n = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct journal_head) &&
+        (data = malloc((size_t)st.st_size)) != NULL) {
+        ssize_t r;
+        while (n < (size_t)st.st_size &&
+               (r = pread(fd, data + n, (size_t)st.st_size - n, (off_t)n)) > 0) n += (size_t)r;
+    }
+    if (n < sizeof(struct journal_head) || memcmp(data, &j->base, sizeof j->base) != 0) {
+        // written against another version of the file: leave it alone
+        set_status_message("Journal %s does not match the file; not replayed", j->path);
+        j->off = true;
+        free(data);
+        close(fd);
+        return;
+    }
+
+    // replay against the whole file
+    while (E.buf->index) {
+        struct pollfd pfd = { .fd = E.buf->index->pipe[0], .events = POLLIN };
+        while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {}
+        on_index_pipe(pfd.fd);
+    }
+    int count = 0;
+    size_t used = journal_replay(data, n, &count);
+    free(data);
+    if (ftruncate(fd, (off_t)used) == -1 || lseek(fd, (off_t)used, SEEK_SET) == -1) {
+        close(fd);
+        journal_fail();
+        return;
+    }
+    j->fd = fd;
+    j->size = used;
+    j->synced = 0;
+    if (count) set_status_message("Recovered %d edits from %s", count, j->path);
+}
+
+// Journal size to hand to journal_saved() once the current state is saved.
+static size_t journal_mark(void) {
+    journal_flush();
+    return E.buf->journal.fd >= 0 ? E.buf->journal.size : sizeof(struct journal_head);
+}
+
+// The buffer as of `mark` is on disk: keep only the later records, now
+// against the saved file.
+static void journal_saved(size_t mark) {
+    struct journal_log *j = &E.buf->journal;
+    journal_identify(E.buf->filename, &j->base);
+    if (j->off || j->fd < 0) return;
+    journal_flush();
+    if (j->size <= mark) { journal_close(true); return; }
+
+    size_t n = j->size - mark, got = 0;
+    char *tail = malloc(n);
+    if (!tail) die("malloc");
+    ssize_t r;
+    while (got < n && (r = pread(j->fd, tail + got, n - got, (off_t)(mark + got))) > 0)
+        got += (size_t)r;
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", j->path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd != -1 && got == n && write_all(fd, &j->base, sizeof j->base) &&
+              write_all(fd, tail, n) && fdatasync(fd) == 0 && rename(tmp, j->path) == 0;
+    free(tail);
+    if (!ok) {
+        if (fd != -1) { close(fd); unlink(tmp); }
+        journal_fail();
+        return;
+    }
+    close(j->fd);
+    j->fd = fd;
+    j->size = sizeof j->base + n;
+    j->unsynced = false;
+    j->synced = now_ms();
+}
+
+// The terminal went away (or we were told to stop): make every journal
+// durable and exit.
+static void journal_hangup(void) {
+    for (int i = 0; i < E.num_buffers; i++) {
+        E.buf = E.buffers[i];
+        journal_flush();
+        if (E.buf->journal.fd >= 0) fdatasync(E.buf->journal.fd);
+    }
+    exit(1);
+}
+
+/* ---------- Regex ---------- */
+
+/* Patterns are parsed into a small AST and compiled to a Thompson NFA,
+ * once forwards and once reversed. Matching runs lazily built DFAs over
+ * those NFAs: a state is a set of NFA states, and each transition is
+ * worked out the first time it is taken, so the scan stays linear. The
+ * syntax is literals, ., [...] and [^...], \d \w \s (and \D \W \S),
+ * * + ?, |, (...), ^ and $. Matches never span lines. */
+
+typedef struct { uint32_t bits[8]; } rx_class;
+
+static void rx_class_set(rx_class *c, int b) { c->bits[b >> 5] |= 1u << (b & 31); }
+static bool rx_class_has(const rx_class *c, int b) { return c->bits[b >> 5] >> (b & 31) & 1; }
+
+static int rx_class_single(const rx_class *c) {
+    int found = -1;
+    for (int b = 0; b < 256; b++) {
+        if (!rx_class_has(c, b)) continue;
+        if (found >= 0) return -1;
+        found = b;
+    }
+    return found;
+}
+
+enum { RX_LIT, RX_CAT, RX_ALT, RX_STAR, RX_PLUS, RX_QUEST, RX_BOL, RX_EOL, RX_EMPTY };
+
+struct rx_node { int type, a, b, cls; };
+
+#define RX_MAX_NODES 256
+
+struct rx_parser {
+    const char *p, *end;
+    struct rx_node nodes[RX_MAX_NODES];
+    int nnodes;
+    rx_class classes[RX_MAX_NODES];
+    int nclasses;
+    bool error;
+};
+
+static int rx_node(struct rx_parser *ps, int type, int a, int b) {
+    if (ps->nnodes == RX_MAX_NODES) { ps->error = true; return 0; }
+    ps->nodes[ps->nnodes] = (struct rx_node){ type, a, b, -1 };
+    return ps->nnodes++;
+}
+
+static int rx_new_class(struct rx_parser *ps) {
+    if (ps->nclasses == RX_MAX_NODES) { ps->error = true; return 0; }
+    memset(&ps->classes[ps->nclasses], 0, sizeof(rx_class));
+    return ps->nclasses++;
+}
+
+// \d \w \s and friends; returns false for a plain escaped byte.
+static bool rx_class_escape(rx_class *c, char e) {
+    bool neg = isupper((unsigned char)e);
+    int (*pred)(int);
+    switch (tolower((unsigned char)e)) {
+        case 'd': pred = isdigit; break;
+        case 's': pred = isspace; break;
+        case 'w': pred = isalnum; break;
+        default: return false;
+    }
+    for (int b = 0; b < 256; b++) {
+        bool in = pred(b) || (tolower((unsigned char)e) == 'w' && b == '_');
+        if (in != neg) rx_class_set(c, b);
+    }
+    return true;
+}
+
+static int rx_escaped_byte(char e) {
+    switch (e) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        default: return (unsigned char)e;
+    }
+}
+
+static int rx_parse_alt(struct rx_parser *ps);
+
+static int rx_parse_bracket(struct rx_parser *ps) {
+    int ci = rx_new_class(ps);
+    rx_class *c = &ps->classes[ci];
+    bool neg = ps->p < ps->end && *ps->p == '^';
+    if (neg) ps->p++;
+    bool first = true;
+    while (ps->p < ps->end && (*ps->p != ']' || first)) {
+        first = false;
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\' && ps->p < ps->end) {
+            char e = *ps->p++;
+            if (rx_class_escape(c, e)) continue;
+            lo = rx_escaped_byte(e);
+        }
+        int hi = lo;
+        if (ps->p + 1 < ps->end && *ps->p == '-' && ps->p[1] != ']') {
+            ps->p++;
+            hi = (unsigned char)*ps->p++;
+            if (hi == '\\' && ps->p < ps->end) hi = rx_escaped_byte(*ps->p++);
+            if (hi < lo) { ps->error = true; return 0; }
+        }
+        for (int b = lo; b <= hi; b++) rx_class_set(c, b);
+    }
+    if (ps->p == ps->end) { ps->error = true; return 0; }
+    ps->p++;                                        // ']'
+    if (neg) for (int i = 0; i < 8; i++) c->bits[i] = ~c->bits[i];
+    int n = rx_node(ps, RX_LIT, 0, 0);
+    ps->nodes[n].cls = ci;
+    return n;
+}
+
+static int rx_parse_atom(struct rx_parser *ps) {
+    char ch = *ps->p++;
+    if (ch == '(') {
+        int n = rx_parse_alt(ps);
+        if (ps->p == ps->end || *ps->p != ')') { ps->error = true; return 0; }
+        ps->p++;
+        return n;
+    }
+    if (ch == '[') return rx_parse_bracket(ps);
+    if (ch == '^') return rx_node(ps, RX_BOL, 0, 0);
+    if (ch == '$') return rx_node(ps, RX_EOL, 0, 0);
+    if (ch == '*' || ch == '+' || ch == '?' || ch == ')') { ps->error = true; return 0; }
+
+    int ci = rx_new_class(ps);
+    rx_class *c = &ps->classes[ci];
+    if (ch == '.') {
+        for (int i = 0; i < 8; i++) c->bits[i] = ~0u;
+    } else if (ch == '\\' && ps->p < ps->end) {
+        char e = *ps->p++;
+        if (!rx_class_escape(c, e)) rx_class_set(c, rx_escaped_byte(e));
+    } else {
+        rx_class_set(c, (unsigned char)ch);
+    }
+    int n = rx_node(ps, RX_LIT, 0, 0);
+    ps->nodes[n].cls = ci;
+    return n;
+}
+
+static int rx_parse_repeat(struct rx_parser *ps) {
+    int n = rx_parse_atom(ps);
+    while (!ps->error && ps->p < ps->end && strchr("*+?", *ps->p)) {
+        char op = *ps->p++;
+        n = rx_node(ps, op == '*' ? RX_STAR : op == '+' ? RX_PLUS : RX_QUEST, n, 0);
+    }
+    return n;
+}
+
+static int rx_parse_concat(struct rx_parser *ps) {
+    int items[RX_MAX_NODES + 1], k = 0;
+    while (!ps->error && ps->p < ps->end && *ps->p != '|' && *ps->p != ')')
+        items[k++] = rx_parse_repeat(ps);
+    if (k == 0) return rx_node(ps, RX_EMPTY, 0, 0);
+    int n = items[--k];
+    while (k > 0) n = rx_node(ps, RX_CAT, items[--k], n);
+    return n;
+}
+
+static int rx_parse_alt(struct rx_parser *ps) {
+    int n = rx_parse_concat(ps);
+    while (!ps->error && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        n = rx_node(ps, RX_ALT, n, rx_parse_concat(ps));
+    }
+    return n;
+}
+
+enum { NFA_CLASS, NFA_SPLIT, NFA_AT_START, NFA_AT_END, NFA_MATCH };
+
+struct nfa_state { int op, out, out1, cls; };
+
+struct nfa {
+    struct nfa_state *s;
+    int n, start;
+};
+
+struct regex {
+    rx_class *classes;
+    struct nfa fwd, rev;
+    char prefix[64];            // literal every match starts with
+    size_t prefix_len;
+};
+
+static int nfa_add(struct nfa *nfa, int op, int out, int out1, int cls) {
+    nfa->s[nfa->n] = (struct nfa_state){ op, out, out1, cls };
+    return nfa->n++;
+}
+
+/* Emit states matching node and then continuing at `next`; returns the
+ * entry state. Building back to front needs no patch lists. With
+ * `reverse` the NFA matches the reversed text, so ^ and $ swap. */
+static int nfa_emit(struct nfa *nfa, const struct rx_parser *ps, int node, int next, bool reverse) {
+    const struct rx_node *nd = &ps->nodes[node];
+    int loop;
+    switch (nd->type) {
+        case RX_LIT: return nfa_add(nfa, NFA_CLASS, next, -1, nd->cls);
+        case RX_CAT:
+            return reverse ? nfa_emit(nfa, ps, nd->b, nfa_emit(nfa, ps, nd->a, next, reverse), reverse)
+                           : nfa_emit(nfa, ps, nd->a, nfa_emit(nfa, ps, nd->b, next, reverse), reverse);
+        case RX_ALT: {
+            int a = nfa_emit(nfa, ps, nd->a, next, reverse);
+            int b = nfa_emit(nfa, ps, nd->b, next, reverse);
+            return nfa_add(nfa, NFA_SPLIT, a, b, -1);
+        }
+        case RX_STAR:
+        case RX_PLUS:
+            loop = nfa_add(nfa, NFA_SPLIT, -1, next, -1);
+            nfa->s[loop].out = nfa_emit(nfa, ps, nd->a, loop, reverse);
+            return nd->type == RX_STAR ? loop : nfa->s[loop].out;
+        case RX_QUEST: return nfa_add(nfa, NFA_SPLIT, nfa_emit(nfa, ps, nd->a, next, reverse), next, -1);
+        case RX_BOL: return nfa_add(nfa, reverse ? NFA_AT_END : NFA_AT_START, next, -1, -1);
+        case RX_EOL: return nfa_add(nfa, reverse ? NFA_AT_START : NFA_AT_END, next, -1, -1);
+    }
+    return next;                                    // RX_EMPTY
+}
+
+static void nfa_build(struct nfa *nfa, const struct rx_parser *ps, int root, bool reverse) {
+    nfa->s = malloc(sizeof(struct nfa_state) * (size_t)(ps->nnodes + 1));
+    if (!nfa->s) die("malloc");
+    nfa->n = 0;
+    nfa->start = nfa_emit(nfa, ps, root, nfa_add(nfa, NFA_MATCH, -1, -1, -1), reverse);
+}
+
+static void regex_free(struct regex *re) {
+    if (!re) return;
+    free(re->classes);
+    free(re->fwd.s);
+    free(re->rev.s);
+    free(re);
+}
+
+// Compile pattern; NULL if it does not parse.
+static struct regex *regex_compile(const char *pat, size_t len) {
+    struct rx_parser *ps = malloc(sizeof(*ps));
+    if (!ps) die("malloc");
+    ps->p = pat;
+    ps->end = pat + len;
+    ps->nnodes = ps->nclasses = 0;
+    ps->error = false;
+    int root = rx_parse_alt(ps);
+    if (ps->error || ps->p != ps->end) { free(ps); return NULL; }
+
+    struct regex *re = calloc(1, sizeof(*re));
+    if (!re) die("calloc");
+    re->classes = malloc(sizeof(rx_class) * (size_t)(ps->nclasses ? ps->nclasses : 1));
+    if (!re->classes) die("malloc");
+    for (int i = 0; i < ps->nclasses; i++) {
+        re->classes[i] = ps->classes[i];
+        re->classes[i].bits['\n' >> 5] &= ~(1u << ('\n' & 31));     // matches stay on one line
+    }
+    nfa_build(&re->fwd, ps, root, false);
+    nfa_build(&re->rev, ps, root, true);
+
+    // the literal prefix: leading single-byte atoms, stepping over a ^
+    int n = root;
+    for (;;) {
+        const struct rx_node *nd = &ps->nodes[n];
+        int head = nd->type == RX_CAT ? nd->a : n;
+        const struct rx_node *h = &ps->nodes[head];
+        int b = h->type == RX_LIT ? rx_class_single(&re->classes[h->cls]) : -1;
+        if (b >= 0 && re->prefix_len < sizeof(re->prefix)) re->prefix[re->prefix_len++] = (char)b;
+        else if (!(h->type == RX_BOL && re->prefix_len == 0)) break;
+        if (nd->type != RX_CAT) break;
+        n = nd->b;
+    }
+    free(ps);
+    return re;
+}
+
+/* A lazily built DFA. Sets of NFA states are interned as DFA states;
+ * when REGEX_DFA_STATES is reached the whole cache is thrown away and
+ * rebuilt as needed. An unanchored DFA re-enters the start state after
+ * every byte, minus anything that only leads to an empty match, so it
+ * finds non-empty matches starting anywhere. Each search worker has its
+ * own. */
+
+enum { RXD_MATCH = 1, RXD_MATCH_END = 2, RXD_DEAD = 4 };
+
+struct rx_dfa {
+    const struct nfa *nfa;
+    const rx_class *classes;
+    bool unanchored;
+    int nstates;
+    int32_t *trans;             // nstates x 256, -1 until worked out
+    uint8_t *flags;
+    size_t *set_off;
+    int *set_len;
+    int *pool;
+    size_t pool_len, pool_cap;
+    int *hash;                  // state ids by set, -1 for empty slots
+    size_t hash_cap;
+    int start[2];               // by at_start, -1 until built
+    int *stack, *mark, *tmp;
+    int gen, ntmp;
+};
+
+static void dfa_flush(struct rx_dfa *d) {
+    d->nstates = 0;
+    d->pool_len = 0;
+    memset(d->hash, -1, sizeof(int) * d->hash_cap);
+    d->start[0] = d->start[1] = -1;
+}
+
+static void dfa_init(struct rx_dfa *d, const struct nfa *nfa, const rx_class *classes, bool unanchored) {
+    memset(d, 0, sizeof(*d));
+    d->nfa = nfa;
+    d->classes = classes;
+    d->unanchored = unanchored;
+    d->hash_cap = 2 * REGEX_DFA_STATES;
+    d->trans = malloc(sizeof(int32_t) * 256 * REGEX_DFA_STATES);
+    d->flags = malloc(REGEX_DFA_STATES);
+    d->set_off = malloc(sizeof(size_t) * REGEX_DFA_STATES);
+    d->set_len = malloc(sizeof(int) * REGEX_DFA_STATES);
+    d->hash = malloc(sizeof(int) * d->hash_cap);
+    d->stack = malloc(sizeof(int) * (size_t)(2 * nfa->n + 2));
+    d->mark = calloc((size_t)nfa->n, sizeof(int));
+    d->tmp = malloc(sizeof(int) * (size_t)nfa->n);
+    if (!d->trans || !d->flags || !d->set_off || !d->set_len || !d->hash || !d->stack ||
+        !d->mark || !d->tmp) die("malloc");
+    dfa_flush(d);
+}
+
+static void dfa_free(struct rx_dfa *d) {
+    free(d->trans); free(d->flags); free(d->set_off); free(d->set_len);
+    free(d->pool); free(d->hash); free(d->stack); free(d->mark); free(d->tmp);
+}
+
+// Add the epsilon closure of NFA state s to d->tmp (marks by d->gen).
+// With `nonempty` nothing that could only end an empty match is kept.
+static void dfa_closure(struct rx_dfa *d, int s, bool at_start, bool nonempty) {
+    int sp = 0;
+    d->stack[sp++] = s;
+    while (sp) {
+        int i = d->stack[--sp];
+        if (i < 0 || d->mark[i] == d->gen) continue;
+        d->mark[i] = d->gen;
+        const struct nfa_state *st = &d->nfa->s[i];
+        switch (st->op) {
+            case NFA_SPLIT: d->stack[sp++] = st->out1; d->stack[sp++] = st->out; break;
+            case NFA_AT_START: if (at_start) d->stack[sp++] = st->out; break;
+            case NFA_MATCH: case NFA_AT_END: if (!nonempty) d->tmp[d->ntmp++] = i; break;
+            default: d->tmp[d->ntmp++] = i; break;     // NFA_CLASS
+        }
+    }
+}
+
+// Does the state set reach a match once the end of the line is asserted?
+static bool dfa_match_at_end(struct rx_dfa *d, const int *set, int n) {
+    d->gen++;
+    int sp = 0;
+    for (int k = 0; k < n; k++)
+        if (d->nfa->s[set[k]].op == NFA_AT_END) d->stack[sp++] = d->nfa->s[set[k]].out;
+    while (sp) {
+        int i = d->stack[--sp];
+        if (i < 0 || d->mark[i] == d->gen) continue;
+        d->mark[i] = d->gen;
+        const struct nfa_state *st = &d->nfa->s[i];
+        if (st->op == NFA_MATCH) return true;
+        if (st->op == NFA_SPLIT) { d->stack[sp++] = st->out1; d->stack[sp++] = st->out; }
+        else if (st->op == NFA_AT_END) d->stack[sp++] = st->out;
+    }
+    return false;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    return (*(const int *)a > *(const int *)b) - (*(const int *)a < *(const int *)b);
+}
+
+// Intern d->tmp as a DFA state. *flushed is set if that emptied the cache.
+static int dfa_intern(struct rx_dfa *d, bool *flushed) {
+    int n = d->ntmp;
+    qsort(d->tmp, (size_t)n, sizeof(int), cmp_int);
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < n; i++) h = (h ^ (uint32_t)d->tmp[i]) * 16777619u;
+    *flushed = false;
+    size_t slot = h & (d->hash_cap - 1);
+    for (; d->hash[slot] >= 0; slot = (slot + 1) & (d->hash_cap - 1)) {
+        int id = d->hash[slot];
+        if (d->set_len[id] == n && memcmp(d->pool + d->set_off[id], d->tmp, sizeof(int) * (size_t)n) == 0)
+            return id;
+    }
+    if (d->nstates == REGEX_DFA_STATES) {
+        dfa_flush(d);
+        *flushed = true;
+        for (slot = h & (d->hash_cap - 1); d->hash[slot] >= 0; slot = (slot + 1) & (d->hash_cap - 1)) {}
+    }
+    if (d->pool_len + (size_t)n > d->pool_cap) {
+        size_t cap = d->pool_cap ? d->pool_cap : 1024;
+        while (cap < d->pool_len + (size_t)n) cap *= 2;
+        int *p = realloc(d->pool, sizeof(int) * cap);
+        if (!p) die("realloc");
+        d->pool = p; d->pool_cap = cap;
+    }
+    int id = d->nstates++;
+    memcpy(d->pool + d->pool_len, d->tmp, sizeof(int) * (size_t)n);
+    d->set_off[id] = d->pool_len;
+    d->set_len[id] = n;
+    d->pool_len += (size_t)n;
+    d->hash[slot] = id;
+    memset(d->trans + (size_t)id * 256, -1, sizeof(int32_t) * 256);
+    uint8_t f = 0;
+    for (int i = 0; i < n; i++) if (d->nfa->s[d->tmp[i]].op == NFA_MATCH) f |= RXD_MATCH;
+    if (dfa_match_at_end(d, d->pool + d->set_off[id], n)) f |= RXD_MATCH_END;
+    if (n == 0) f |= RXD_DEAD;
+    d->flags[id] = f;
+    return id;
+}
+
+static int dfa_start(struct rx_dfa *d, bool at_start) {
+    if (d->start[at_start] >= 0) return d->start[at_start];
+    d->gen++;
+    d->ntmp = 0;
+    dfa_closure(d, d->nfa->start, at_start, d->unanchored);
+    bool flushed;
+    int id = dfa_intern(d, &flushed);
+    d->start[at_start] = id;
+    return id;
+}
+
+static int dfa_step(struct rx_dfa *d, int s, int c) {
+    int32_t t = d->trans[(size_t)s * 256 + (size_t)c];
+    if (t >= 0) return t;
+    d->gen++;
+    d->ntmp = 0;
+    const int *set = d->pool + d->set_off[s];
+    for (int i = 0; i < d->set_len[s]; i++) {
+        const struct nfa_state *st = &d->nfa->s[set[i]];
+        if (st->op == NFA_CLASS && rx_class_has(&d->classes[st->cls], c))
+            dfa_closure(d, st->out, false, false);
+    }
+    if (d->unanchored) dfa_closure(d, d->nfa->start, false, true);
+    bool flushed;
+    t = dfa_intern(d, &flushed);
+    if (!flushed) d->trans[(size_t)s * 256 + (size_t)c] = t;
+    return t;
+}
+
+// End of the longest non-empty match starting at p in line [ls, le), or NULL.
+static const char *rx_match_at(struct rx_dfa *fwd, const char *ls, const char *p, const char *le) {
+    int s = dfa_start(fwd, p == ls);
+    const char *end = NULL;
+    for (const char *q = p; q < le; ) {
+        s = dfa_step(fwd, s, (unsigned char)*q++);
+        uint8_t f = fwd->flags[s];
+        if (f & RXD_DEAD) break;
+        if ((f & RXD_MATCH) || (q == le && (f & RXD_MATCH_END))) end = q;
+    }
+    return end;
+}
+
+// Set bit i of `starts` for every ls + i where a non-empty match in line
+// [ls, le) begins: one pass of the reversed pattern back from the end of
+// the line. Returns false if there is none.
+static bool rx_starts(struct rx_dfa *rev, const char *ls, const char *le, uint64_t *starts) {
+    int s = dfa_start(rev, true);
+    bool any = false;
+    memset(starts, 0, sizeof(uint64_t) * (((size_t)(le - ls) + 63) / 64));
+    for (const char *q = le; q > ls; ) {
+        s = dfa_step(rev, s, (unsigned char)*--q);
+        uint8_t f = rev->flags[s];
+        if ((f & RXD_MATCH) || (q == ls && (f & RXD_MATCH_END))) {
+            size_t i = (size_t)(q - ls);
+            starts[i / 64] |= 1ull << (i % 64);
+            any = true;
+        }
+    }
+    return any;
+}
+
+// First set bit of starts[] at or after i, or n if there is none before n.
+static size_t rx_next_start(const uint64_t *starts, size_t i, size_t n) {
+    while (i < n) {
+        uint64_t w = starts[i / 64] >> (i % 64);
+        if (w) { i += (size_t)__builtin_ctzll(w); break; }
+        i = (i / 64 + 1) * 64;
+    }
+    return i < n ? i : n;
+}
+
+/* ---------- Search ---------- */
+
+/* Horspool: on a mismatch the window moves by the shift of its last byte,
+ * usually the whole needle length. One-byte needles go to memchr. */
+struct searcher {
+    const char *needle;
+    size_t len;
+    size_t shift[256];
+};
+
+static void searcher_init(struct searcher *sr, const char *needle, size_t len) {
+    sr->needle = needle;
+    sr->len = len;
+    for (int c = 0; c < 256; c++) sr->shift[c] = len;
+    for (size_t i = 0; i + 1 < len; i++) sr->shift[(unsigned char)needle[i]] = len - 1 - i;
+}
+
+static const char *searcher_find(const struct searcher *sr, const char *hay, size_t n) {
+    size_t m = sr->len;
+    if (m == 0 || n < m) return NULL;
+    if (m == 1) return memchr(hay, sr->needle[0], n);
+    const unsigned char last = (unsigned char)sr->needle[m - 1];
+    for (size_t i = 0; i <= n - m; ) {
+        unsigned char c = (unsigned char)hay[i + m - 1];
+        if (c == last && memcmp(hay + i, sr->needle, m - 1) == 0) return hay + i;
+        i += sr->shift[c];
+    }
+    return NULL;
+}
+
+/* A search runs on worker threads over a snapshot of the buffer: unedited
+ * spans are read straight from the mapping, edited blocks are copied, and
+ * the part of the file the indexer has not reached yet is searched from
+ * the mapping in SEARCH_CHUNK pieces. Nobody knows where the lines of
+ * those pieces start yet, so each worker counts the lines of its own
+ * pieces first and takes its first line number once the workers before
+ * it have counted theirs. The
+ * segments are dealt out to the workers in order, so bucket i only holds
+ * matches before those of bucket i + 1 and the buckets together form one
+ * sorted index. Workers publish as they go; the main thread is woken
+ * through search_pipe. */
+
+struct search_hit {
+    int y;
+    uint32_t len;
+    size_t x;
+    const char *at;             // the match in the job's snapshot
+};
+
+struct search_seg {
+    const char *p;
+    size_t len;
+    int first_line;
+};
+
+struct search_bucket {
+    struct search_job *job;
+    size_t seg_begin, seg_end;
+    size_t tail_begin;          // its segments from here on are unindexed text
+    int tail_lines;             // lines in those, -1 until counted
+    int first_line, end_line;   // lines [first_line, end_line); guarded by
+                                // job->lock until the tail is counted
+    struct search_hit *hits;    // guarded by job->lock
+    size_t count, cap;
+    bool done;
+};
+
+struct search_job {
+    const struct editor_buffer *buf;
+    unsigned long change_count; // of buf when the snapshot was taken
+    struct search_job *base;    // narrowing: the job whose hits are checked
+    const struct search_job *snap;  // the job owning segs and text (maybe itself)
+    char needle[64];
+    struct searcher sr;         // the needle, or the regex's literal prefix
+    struct regex *re;           // NULL for a plain text search
+    struct search_seg *segs;
+    size_t nsegs;
+    int tail_line;              // first line of the unindexed text
+    char *text;                 // copies of the edited rows
+    struct search_bucket buckets[SEARCH_THREADS];
+    int nbuckets;
+    pthread_mutex_t lock;
+    pthread_cond_t counted;     // a bucket has counted its unindexed lines
+    int refs;                   // running workers + the main thread
+    int cancel;
+};
+
+static bool search_cancelled(const struct search_job *job) {
+    return __atomic_load_n(&job->cancel, __ATOMIC_RELAXED);
+}
+
+static int search_pipe[2] = { -1, -1 };
+
+static void search_job_unref(struct search_job *job) {
+    pthread_mutex_lock(&job->lock);
+    bool last = --job->refs == 0;
+    pthread_mutex_unlock(&job->lock);
+    if (!last) return;
+    for (int i = 0; i < job->nbuckets; i++) free(job->buckets[i].hits);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->counted);
+    regex_free(job->re);
+    free(job->segs);
+    free(job->text);
+    if (job->base) search_job_unref(job->base);
+    free(job);
+}
+
+static void search_publish(struct search_bucket *bk, struct search_hit *hits, size_t n, bool done) {
+    struct search_job *job = bk->job;
+    pthread_mutex_lock(&job->lock);
+    if (bk->count + n > bk->cap) {
+        size_t cap = bk->cap ? bk->cap : 256;
+        while (cap < bk->count + n) cap *= 2;
+        struct search_hit *h = realloc(bk->hits, sizeof(*h) * cap);
+        if (!h) die("realloc");
+        bk->hits = h; bk->cap = cap;
+    }
+    if (n) memcpy(bk->hits + bk->count, hits, sizeof(*hits) * n);
+    bk->count += n;
+    bk->done = done;
+    pthread_mutex_unlock(&job->lock);
+    if (write(search_pipe[1], "s", 1) < 0) { /* pipe full: a wakeup is pending anyway */ }
+}
+
+// Matches are collected locally and published in batches.
+struct hit_sink {
+    struct search_bucket *bk;
+    struct search_hit hits[4096];
+    size_t n;
+    uint64_t *starts;           // match starts of the current line (regex)
+    size_t starts_cap;          // in words
+};
+
+// Returns false once the search has been cancelled.
+static bool sink_add(struct hit_sink *k, int y, size_t x, const char *at, size_t len) {
+    k->hits[k->n].y = y;
+    k->hits[k->n].x = x;
+    k->hits[k->n].at = at;
+    k->hits[k->n].len = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+    if (++k->n < sizeof(k->hits) / sizeof(k->hits[0])) return true;
+    search_publish(k->bk, k->hits, k->n, false);
+    k->n = 0;
+    return !search_cancelled(k->bk->job);
+}
+
+// Hits of the needle, or of the regex prefix followed by a match.
+static void search_seg_find(struct hit_sink *k, const struct search_seg *seg, struct rx_dfa *fwd) {
+    const struct search_job *job = k->bk->job;
+    const char *cur = seg->p, *ls = seg->p, *end = seg->p + seg->len, *h;
+    const char *win = cur;
+    int line = seg->first_line;
+    for (;;) {
+        // look at SEARCH_POLL bytes at a time, checking for a cancel in between
+        size_t n = (size_t)(end - win);
+        if (n > SEARCH_POLL + job->sr.len) n = SEARCH_POLL + job->sr.len;
+        if (!(h = searcher_find(&job->sr, win, n))) {
+            if (win + n == end || search_cancelled(job)) return;
+            win += SEARCH_POLL;
+            continue;
+        }
+        int nl;
+        bool cr = false;
+        newline_scan(cur, h, INT_MAX, &nl, &cr);
+        if (nl) {
+            line += nl;
+            for (ls = h; ls[-1] != '\n'; ls--) {}
+        }
+        const char *e = h + job->sr.len;
+        if (fwd) {
+            const char *le = memchr(h, '\n', (size_t)(end - h));
+            if (!le) le = end;
+            if (le > h && le[-1] == '\r') le--;
+            e = rx_match_at(fwd, ls, h, le);
+            if (!e) { win = cur = h + 1; continue; }
+        }
+        if (!sink_add(k, line, (size_t)(h - ls), h, (size_t)(e - h))) return;
+        win = cur = fwd ? e : h + 1;
+    }
+}
+
+// A regex without a literal prefix: every line goes through the DFAs.
+// The reversed pattern marks all match starts of a line in one pass, and
+// each match is then taken, longest first, from the leftmost start not
+// inside the previous one; a line full of matches is not rescanned per
+// match.
+static void search_seg_regex(struct hit_sink *k, const struct search_seg *seg,
+                             struct rx_dfa *fwd, struct rx_dfa *rev) {
+    const char *p = seg->p, *end = seg->p + seg->len, *poll = p + SEARCH_POLL;
+    for (int line = seg->first_line; p < end; line++) {
+        if (p >= poll) {
+            if (search_cancelled(k->bk->job)) return;
+            poll = p + SEARCH_POLL;
+        }
+        int nl;
+        bool cr = false;
+        const char *next = newline_scan(p, end, 1, &nl, &cr);
+        const char *le = next - nl;
+        if (le > p && le[-1] == '\r') le--;
+        size_t n = (size_t)(le - p), words = (n + 63) / 64;
+        if (words > k->starts_cap) {
+            uint64_t *w = realloc(k->starts, sizeof(uint64_t) * words);
+            if (!w) die("realloc");
+            k->starts = w;
+            k->starts_cap = words;
+        }
+        if (n && rx_starts(rev, p, le, k->starts)) {
+            for (size_t i = rx_next_start(k->starts, 0, n); i < n; ) {
+                const char *e = rx_match_at(fwd, p, p + i, le);
+                if (!e) break;
+                if (!sink_add(k, line, i, p + i, (size_t)(e - p) - i)) return;
+                i = rx_next_start(k->starts, (size_t)(e - p), n);
+            }
+        }
+        p = next;
+    }
+}
+
+// Narrowing: keep the hits of the base bucket `from` that go on with the
+// rest of the needle, checked in place in the snapshot.
+static void search_filter(struct hit_sink *k, const struct search_bucket *from) {
+    const struct search_job *job = k->bk->job;
+    const struct search_seg *segs = job->snap->segs;
+    size_t s = from->seg_begin, m = job->sr.len;
+    for (size_t i = 0; i < from->count; i++) {
+        if (i % 65536 == 0 && search_cancelled(job)) return;
+        const struct search_hit *h = &from->hits[i];
+        // hits and segments are both in order: find the one holding h
+        while (s < from->seg_end && !(h->at >= segs[s].p && h->at < segs[s].p + segs[s].len)) s++;
+        if (s == from->seg_end) break;
+        if ((size_t)(segs[s].p + segs[s].len - h->at) < m || memcmp(h->at, job->needle, m) != 0) continue;
+        if (!sink_add(k, h->y, h->x, h->at, m)) return;
+    }
+}
+
+// Count the lines of the bucket's unindexed segments, then wait for the
+// buckets before it to get their line numbers. False if cancelled.
+static bool search_number_tail(struct search_bucket *bk) {
+    struct search_job *job = bk->job;
+    int lines = 0;
+    for (size_t s = bk->tail_begin; s < bk->seg_end; s++) {
+        if (search_cancelled(job)) break;
+        struct search_seg *seg = &job->segs[s];
+        int nl;
+        bool cr = false;
+        newline_scan(seg->p, seg->p + seg->len, INT_MAX, &nl, &cr);
+        seg->first_line = lines;    // relative until the base is known
+        lines += nl;
+    }
+    pthread_mutex_lock(&job->lock);
+    bk->tail_lines = lines;
+    pthread_cond_broadcast(&job->counted);
+    int base;
+    bool ready;
+    for (;;) {
+        base = job->tail_line;
+        ready = true;
+        for (struct search_bucket *b = job->buckets; b < bk && ready; b++) {
+            if (b->tail_lines < 0) ready = false;
+            else base += b->tail_lines;
+        }
+        if (ready || search_cancelled(job)) break;
+        pthread_cond_wait(&job->counted, &job->lock);
+    }
+    if (ready) {
+        for (size_t s = bk->tail_begin; s < bk->seg_end; s++) job->segs[s].first_line += base;
+        if (bk->tail_begin == bk->seg_begin) bk->first_line = base;
+        if (bk->seg_end < job->nsegs) bk->end_line = base + lines;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return ready && !search_cancelled(job);
+}
+
+static void *search_worker(void *arg) {
+    struct search_bucket *bk = arg;
+    struct search_job *job = bk->job;
+    struct hit_sink *k = malloc(sizeof(*k));
+    if (!k) die("malloc");
+    k->bk = bk;
+    k->n = 0;
+    k->starts = NULL;
+    k->starts_cap = 0;
+    struct rx_dfa fwd, rev;
+    if (job->re) {
+        dfa_init(&fwd, &job->re->fwd, job->re->classes, false);
+        dfa_init(&rev, &job->re->rev, job->re->classes, true);
+    }
+    bool go = bk->tail_begin == bk->seg_end || search_number_tail(bk);
+    if (job->base) {
+        search_filter(k, &job->base->buckets[bk - job->buckets]);
+        go = false;
+    }
+    for (size_t s = bk->seg_begin; go && s < bk->seg_end; s++) {
+        if (search_cancelled(job)) break;
+        if (job->re && !job->re->prefix_len) search_seg_regex(k, &job->segs[s], &fwd, &rev);
+        else search_seg_find(k, &job->segs[s], job->re ? &fwd : NULL);
+        if (k->n) { search_publish(bk, k->hits, k->n, false); k->n = 0; }
+    }
+    search_publish(bk, k->hits, k->n, true);
+    if (job->re) { dfa_free(&fwd); dfa_free(&rev); }
+    free(k->starts);
+    free(k);
+    search_job_unref(job);
+    return NULL;
+}
+
+static void on_search_pipe(int fd);
+
+static void search_job_run(struct search_job *job) {
+    job->refs = job->nbuckets + 1;
+    for (int i = 0; i < job->nbuckets; i++) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, search_worker, &job->buckets[i]) == 0) pthread_detach(th);
+        else search_worker(&job->buckets[i]);
+    }
+}
+
+// Snapshot the buffer and start searching it for needle, or for the
+// compiled regex re (which the job takes over).
+static struct search_job *search_job_start(const char *needle, size_t len, struct regex *re) {
+    struct search_job *job = calloc(1, sizeof(*job));
+    if (!job) die("calloc");
+    job->buf = E.buf;
+    job->change_count = E.buf->change_count;
+    job->snap = job;
+    job->re = re;
+    if (re) { needle = re->prefix; len = re->prefix_len; }
+    memcpy(job->needle, needle, len);
+    searcher_init(&job->sr, job->needle, len);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->counted, NULL);
+    if (search_pipe[0] < 0) {
+        if (pipe(search_pipe) == -1) die("pipe");
+        for (int i = 0; i < 2; i++) fcntl(search_pipe[i], F_SETFL, fcntl(search_pipe[i], F_GETFL) | O_NONBLOCK);
+        event_watch_fd(search_pipe[0], on_search_pipe);
+    }
+
+    // edited blocks are copied one row per line into job->text first
+    size_t text_len = 0, total = 0;
+    for (int b = 0; b < E.buf->num_blocks; b++)
+        if (!E.buf->blocks[b].span)
+            for (int i = 0; i < E.buf->blocks[b].num_rows; i++) text_len += E.buf->blocks[b].rows[i].length + 1;
+    const struct line_index *ix = E.buf->index;
+    size_t tail = ix ? ix->size - ix->loaded_end : 0;
+    job->text = malloc(text_len ? text_len : 1);
+    job->segs = malloc(sizeof(struct search_seg) * ((size_t)E.buf->num_blocks + tail / SEARCH_CHUNK + 1));
+    if (!job->text || !job->segs) die("malloc");
+    char *t = job->text;
+    int line = 0;
+    for (int b = 0; b < E.buf->num_blocks; b++) {
+        row_block *blk = &E.buf->blocks[b];
+        struct search_seg *seg = &job->segs[job->nsegs++];
+        seg->first_line = line;
+        if (blk->span) {
+            seg->p = blk->span;
+            seg->len = blk->span_len;
+        } else {
+            seg->p = t;
+            for (int i = 0; i < blk->num_rows; i++) {
+                const char *a, *c;
+                size_t alen, clen;
+                row_runs(&blk->rows[i], &a, &alen, &c, &clen);
+                memcpy(t, a, alen); t += alen;
+                if (clen) { memcpy(t, c, clen); t += clen; }
+                *t++ = '\n';
+            }
+            seg->len = (size_t)(t - seg->p);
+        }
+        total += seg->len;
+        line += blk->num_rows;
+    }
+    // the unindexed text, cut after a newline every SEARCH_CHUNK bytes
+    size_t tail_seg = job->nsegs;
+    job->tail_line = line;
+    if (tail) {
+        const char *p = ix->data + ix->loaded_end, *end = ix->data + ix->size;
+        while (p < end) {
+            const char *q = (size_t)(end - p) > SEARCH_CHUNK ?
+                            memchr(p + SEARCH_CHUNK, '\n', (size_t)(end - p) - SEARCH_CHUNK) : NULL;
+            q = q ? q + 1 : end;
+            struct search_seg *seg = &job->segs[job->nsegs++];
+            seg->first_line = line;     // numbered by the worker (search_number_tail)
+            seg->p = p;
+            seg->len = (size_t)(q - p);
+            p = q;
+        }
+        total += tail;
+        line = INT_MAX;         // how many lines it holds is not known yet
+    }
+
+    int k = 1;
+    if (total >= SEARCH_PARALLEL_MIN) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        k = n < 1 ? 1 : n > SEARCH_THREADS ? SEARCH_THREADS : (int)n;
+    }
+    // deal out the segments in order, about total / k bytes each
+    size_t s = 0, acc = 0;
+    for (int i = 0; i < k; i++) {
+        struct search_bucket *bk = &job->buckets[job->nbuckets++];
+        bk->job = job;
+        bk->seg_begin = s;
+        bk->first_line = s < job->nsegs ? job->segs[s].first_line : line;
+        size_t goal = total / (size_t)k * (size_t)(i + 1);
+        while (s < job->nsegs && (i == k - 1 || acc < goal)) acc += job->segs[s++].len;
+        bk->seg_end = s;
+        bk->end_line = s < job->nsegs ? job->segs[s].first_line : line;
+        bk->tail_begin = bk->seg_begin > tail_seg ? bk->seg_begin : tail_seg;
+        if (bk->tail_begin > bk->seg_end) bk->tail_begin = bk->seg_end;
+        bk->tail_lines = bk->tail_begin < bk->seg_end ? -1 : 0;
+        if (bk->tail_lines < 0) bk->end_line = INT_MAX;   // until counted
+    }
+
+    search_job_run(job);
+    return job;
+}
+
+/* A literal query that only grew can only match where the old one did:
+ * if the old search is finished and the buffer has not changed since, the
+ * new job checks the old hits in the old snapshot instead of scanning the
+ * buffer again. Follow mode and stdin still add text, so they rescan. */
+static bool search_can_narrow(struct search_job *old, const char *needle, size_t len) {
+    if (!old || old->re || old->sr.len >= len || memcmp(old->needle, needle, old->sr.len) != 0 ||
+        old->buf != E.buf || old->change_count != E.buf->change_count || E.buf->read_only ||
+        (stream.fd >= 0 && stream.dest == E.buf))
+        return false;
+    bool done = true;
+    pthread_mutex_lock(&old->lock);
+    for (int i = 0; i < old->nbuckets; i++) done = done && old->buckets[i].done;
+    pthread_mutex_unlock(&old->lock);
+    return done;
+}
+
+static struct search_job *search_job_narrow(struct search_job *old, const char *needle, size_t len) {
+    struct search_job *job = calloc(1, sizeof(*job));
+    if (!job) die("calloc");
+    job->buf = old->buf;
+    job->change_count = old->change_count;
+    job->base = old;
+    job->snap = old->snap;
+    memcpy(job->needle, needle, len);
+    searcher_init(&job->sr, job->needle, len);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->counted, NULL);
+    pthread_mutex_lock(&old->lock);
+    old->refs++;                // held until this job goes
+    pthread_mutex_unlock(&old->lock);
+    job->tail_line = old->tail_line;
+    job->nbuckets = old->nbuckets;
+    for (int i = 0; i < job->nbuckets; i++) {
+        const struct search_bucket *from = &old->buckets[i];
+        struct search_bucket *bk = &job->buckets[i];
+        bk->job = job;
+        bk->seg_begin = from->seg_begin;
+        bk->seg_end = bk->tail_begin = from->seg_end;  // lines already numbered
+        bk->first_line = from->first_line;
+        bk->end_line = from->end_line;
+    }
+    search_job_run(job);
+    return job;
+}
+
+static void search_job_cancel(struct search_job *job) {
+    if (!job) return;
+    pthread_mutex_lock(&job->lock);
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&job->counted);      // wake workers waiting for line numbers
+    pthread_mutex_unlock(&job->lock);
+    search_job_unref(job);
+}
+
+static bool hit_before(const struct search_hit *h, int y, size_t x) {
+    return h->y < y || (h->y == y && h->x < x);
+}
+
+// Index of the first hit at or after (y, x) in hits[0, n).
+static size_t hits_lower_bound(const struct search_hit *hits, size_t n, int y, size_t x) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (hit_before(&hits[mid], y, x)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+enum { HIT_NONE, HIT_FOUND, HIT_PENDING };
+
+/* The first hit at or after (y, x), or with `backward` the last one
+ * before it, in O(buckets + log n). HIT_PENDING means a bucket that could
+ * still produce a closer one is not finished yet. Caller holds job->lock. */
+static int search_locate(struct search_job *job, int y, size_t x, bool backward,
+                         struct search_hit *out) {
+    if (!backward) {
+        for (int i = 0; i < job->nbuckets; i++) {
+            struct search_bucket *bk = &job->buckets[i];
+            if (bk->end_line <= y) continue;
+            size_t j = hits_lower_bound(bk->hits, bk->count, y, x);
+            if (j < bk->count) { *out = bk->hits[j]; return HIT_FOUND; }
+            if (!bk->done) return HIT_PENDING;
+        }
+    } else {
+        for (int i = job->nbuckets - 1; i >= 0; i--) {
+            struct search_bucket *bk = &job->buckets[i];
+            if (bk->first_line > y) continue;
+            size_t j = hits_lower_bound(bk->hits, bk->count, y, x);
+            if (!bk->done && j == bk->count) return HIT_PENDING;
+            if (j > 0) { *out = bk->hits[j - 1]; return HIT_FOUND; }
+        }
+    }
+    return HIT_NONE;
+}
+
+/* Incremental search state. The query lives in the message bar; every
+ * keystroke continues from the current match instead of the top. A move
+ * that the running search can not answer yet stays pending until more
+ * results come in. */
+static struct {
+    bool active;
+    char query[64];
+    size_t len;
+    int saved_x, saved_y, saved_row_offset, saved_col_offset;
+    size_t saved_wrap_offset;
+    int match_y;                // -1 while there is no current match
+    size_t match_x;
+    struct search_job *job;
+    bool regex;                 // Ctrl-R in the prompt switches to regex mode
+    bool bad_regex;
+    bool pending, pending_back; // a move waiting for results
+    int from_y;                 // where the pending move starts
+    size_t from_x;
+    bool wrapped;
+} search;
+
+static void search_start(void) {
+    search.active = true;
+    search.len = 0;
+    search.query[0] = '\0';
+    search.saved_x = E.buf->cursor_x;
+    search.saved_y = E.buf->cursor_y;
+    search.saved_row_offset = E.buf->row_offset;
+    search.saved_col_offset = E.buf->col_offset;
+    search.saved_wrap_offset = E.buf->wrap_offset;
+    search.match_y = -1;
+    search.pending = false;
+    request_redraw();
+}
+
+static void search_restore(void) {
+    E.buf->cursor_x = search.saved_x;
+    E.buf->cursor_y = search.saved_y;
+    E.buf->row_offset = search.saved_row_offset;
+    E.buf->col_offset = search.saved_col_offset;
+    E.buf->wrap_offset = search.saved_wrap_offset;
+}
+
+static void search_stop(void) {
+    search_job_cancel(search.job);
+    search.job = NULL;
+    search.active = false;
+    search.pending = false;
+    request_redraw();
+}
+
+// Try to finish the pending move with the results so far.
+static void search_resolve(void) {
+    if (!search.pending || !search.job) return;
+    struct search_hit h;
+    pthread_mutex_lock(&search.job->lock);
+    int r = search_locate(search.job, search.from_y, search.from_x, search.pending_back, &h);
+    if (r == HIT_NONE && !search.wrapped) {
+        // nothing further this way: go round the end of the buffer once
+        search.wrapped = true;
+        search.from_y = search.pending_back ? INT_MAX : 0;
+        search.from_x = 0;
+        r = search_locate(search.job, search.from_y, search.from_x, search.pending_back, &h);
+    }
+    pthread_mutex_unlock(&search.job->lock);
+    if (r == HIT_PENDING) return;
+    // a match past the indexed rows is taken once the indexer gets there
+    if (r == HIT_FOUND && h.y >= E.buf->num_rows) return;
+    search.pending = false;
+    request_redraw();
+    if (r == HIT_NONE) { search.match_y = -1; return; }
+    search.match_y = h.y;
+    search.match_x = h.x;
+    E.buf->cursor_y = h.y;
+    E.buf->cursor_x = (int)h.x;
+    int text_rows = E.screen_rows - 2;
+    if (h.y < E.buf->row_offset || h.y >= E.buf->row_offset + text_rows)
+        E.buf->row_offset = h.y > text_rows / 2 ? h.y - text_rows / 2 : 0;
+}
+
+// Move to the next match from the current one (`step` moves past it) or,
+// with no match yet, from where the search started.
+static void search_move(bool backward, bool step) {
+    search.pending = true;
+    search.pending_back = backward;
+    search.wrapped = false;
+    search.from_y = search.saved_y;
+    search.from_x = (size_t)search.saved_x;
+    if (search.match_y >= 0) {
+        search.from_y = search.match_y;
+        search.from_x = search.match_x + (step && !backward);
+    }
+    search_resolve();
+}
+
+// The query changed: drop the running search and start over.
+static void search_restart(void) {
+    struct search_job *old = search.job;
+    search.job = NULL;
+    search.pending = false;
+    request_redraw();
+    search.bad_regex = false;
+    struct regex *re = NULL;
+    if (search.len == 0) {
+        search.match_y = -1;
+        search_restore();
+    } else if (search.regex && !(re = regex_compile(search.query, search.len))) {
+        search.bad_regex = true;
+        search.match_y = -1;
+    } else if (!search.regex && search_can_narrow(old, search.query, search.len)) {
+        search.job = search_job_narrow(old, search.query, search.len);
+    } else {
+        search.job = search_job_start(search.query, search.len, re);
+    }
+    search_job_cancel(old);
+    if (search.job) search_move(false, false);
+}
+
+static void on_search_pipe(int fd) {
+    char buf[256];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+    if (!search.job) return;
+    search_resolve();
+    request_redraw();
+}
+
+static void search_append(const char *s, size_t n) {
+    bool added = false;
+    for (size_t i = 0; i < n && search.len < sizeof(search.query) - 1; i++) {
+        if ((unsigned char)s[i] < 32 || s[i] == 127) continue;
+        search.query[search.len++] = s[i];
+        added = true;
+    }
+    search.query[search.len] = '\0';
+    if (added) search_restart();
+}
+
+static void search_key(int k) {
+    switch (k) {
+        case '\r':
+            search_stop();
+            break;
+        case '\x1b':
+            search_stop();
+            search_restore();
+            break;
+        case 127: case 8:
+            if (search.len == 0) break;
+            // drop a whole UTF-8 character
+            search.len--;
+            while (search.len > 0 && ((unsigned char)search.query[search.len] & 0xc0) == 0x80)
+                search.len--;
+            search.query[search.len] = '\0';
+            search.match_y = -1;        // a shorter query may match earlier
+            search_restart();
+            break;
+        case 18:    /* Ctrl-R */
+            search.regex = !search.regex;
+            search.match_y = -1;
+            search_restart();
+            break;
+        case 6: case ARROW_DOWN: case ARROW_RIGHT: if (search.job) search_move(false, true); break;
+        case ARROW_UP: case ARROW_LEFT: if (search.job) search_move(true, true); break;
+        default:
+            if ((k >= 32 && k < 127) || (k >= 128 && k < 256)) { char c = (char)k; search_append(&c, 1); }
+            break;
+    }
+}
+
+// Matches found so far and whether the search is still running.
+static size_t search_count(bool *running) {
+    size_t n = 0;
+    *running = false;
+    pthread_mutex_lock(&search.job->lock);
+    for (int i = 0; i < search.job->nbuckets; i++) {
+        n += search.job->buckets[i].count;
+        if (!search.job->buckets[i].done) *running = true;
+    }
+    pthread_mutex_unlock(&search.job->lock);
+    return n;
+}
+
+/* ---------- Follow mode ---------- */
+
+/* With -R the file is shown read-only and watched with inotify; whatever
+ * is appended goes onto the end of the row table instead of reloading the
+ * file. Small tails are read into the arena, big ones are mapped and go
+ * through the indexer. An unterminated last line is taken back and read
+ * again once it grows. A file that shrinks was truncated, so it is read
+ * again from the start; the old mappings stay, since search threads may
+ * still be reading them. One buffer is followed at a time. */
+
+static struct {
+    int fd;                 // the followed file, or -1
+    struct editor_buffer *buf;
+    int inotify;
+    size_t size;            // bytes shown so far
+    size_t line_start;      // offset of the last line when it is unterminated
+    bool partial;
+} follow = { .fd = -1, .inotify = -1 };
+
+// Remember whether [start, end) ends in the middle of a line, and where
+// that line began.
+static void follow_note_tail(const char *p, size_t len, size_t start) {
+    follow.partial = len && p[len - 1] != '\n';
+    while (len && p[len - 1] != '\n') len--;
+    if (follow.partial) follow.line_start = start + len;
+}
+
+// Take in what the file gained (in the followed buffer); true when it
+// had to be read again from the start.
+static bool follow_take(const struct stat *st) {
+
+    size_t size = (size_t)st->st_size;
+    bool stick = E.buf->cursor_y >= E.buf->num_rows - 1;
+    bool reloaded = size < follow.size;
+    if (reloaded) {
+        row_table_clear();
+        follow.size = 0;
+        follow.partial = false;
+        E.buf->cursor_y = E.buf->cursor_x = 0;
+        E.buf->row_offset = 0;
+        E.buf->wrap_offset = 0;
+        set_status_message("File truncated, reloaded");
+        if (size == 0) return true;
+    }
+
+    size_t start = follow.partial ? follow.line_start : follow.size;
+    size_t len = size - start;
+    const char *p;
+    if (len <= ARENA_SLAB_SIZE / 4) {
+        char *buf = arena_bump(len, 1);
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = pread(follow.fd, buf + got, len - got, (off_t)(start + got));
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        if (got == 0) return reloaded;
+        p = buf;
+        len = got;
+    } else {
+        size_t off = start & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        char *m = mmap(NULL, size - off, PROT_READ, MAP_PRIVATE, follow.fd, (off_t)off);
+        if (m == MAP_FAILED) { set_status_message("Follow: %s", strerror(errno)); return reloaded; }
+        bus_map_add(m, size - off, follow.buf);
+        p = m + (start - off);
+    }
+
+    if (follow.partial) row_table_drop_last();
+    follow.size = start + len;
+    follow_note_tail(p, len, start);
+    if (len > ARENA_SLAB_SIZE / 4) {
+        index_start(p, len);
+    } else {
+        int lines;
+        bool cr = false;
+        newline_scan(p, p + len, INT_MAX, &lines, &cr);
+        if (p[len - 1] != '\n') lines++;
+        note_line_end(p, len);
+        row_table_append_span(p, len, lines);
+    }
+    if (stick && E.buf->num_rows) { E.buf->cursor_y = E.buf->num_rows - 1; E.buf->cursor_x = 0; }
+    return reloaded;
+}
+
+static void follow_check(void) {
+    if (follow.fd < 0) return;
+    if (follow.buf->index) return;  // on_index_pipe() checks again when it is done
+    struct stat st;
+    if (fstat(follow.fd, &st) == -1 || (size_t)st.st_size == follow.size) return;
+    request_redraw();
+    struct editor_buffer *cur = E.buf;
+    E.buf = follow.buf;
+    bool reloaded = follow_take(&st);
+    E.buf = cur;
+    if (reloaded && search.active && E.buf == follow.buf) search_restart();
+}
+
+static void on_follow_event(int fd) {
+    char buf[4096];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+    follow_check();
+}
+
+// Start following the file open_file() has just loaded.
+static void follow_start(const char *path) {
+    struct stat st;
+    if (follow.fd >= 0) {
+        set_status_message("Already following %s; %s is read-only", follow.buf->filename, path ? path : "");
+        return;
+    }
+    follow.fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (follow.fd == -1 || fstat(follow.fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        set_status_message("Can not follow %s", path ? path : "(no file)");
+        if (follow.fd != -1) close(follow.fd);
+        follow.fd = -1;
+        return;
+    }
+    follow.buf = E.buf;
+    follow.size = E.buf->map ? E.buf->map_size : 0;
+    if (E.buf->map) follow_note_tail(E.buf->map, E.buf->map_size, 0);
+    follow.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow.inotify == -1 || inotify_add_watch(follow.inotify, path, IN_MODIFY) == -1) {
+        // back out completely, so a later follow_start() can try again
+        set_status_message("inotify: %s", strerror(errno));
+        if (follow.inotify != -1) close(follow.inotify);
+        close(follow.fd);
+        follow.inotify = follow.fd = -1;
+        follow.buf = NULL;
+        return;
+    }
+    event_watch_fd(follow.inotify, on_follow_event);
+    E.buf->cursor_y = E.buf->num_rows ? E.buf->num_rows - 1 : 0;
+    set_status_message("Following %s (read-only)", path);
+    follow_check();
+}
+
+/* ---------- Stats ---------- */
+
+#if NED_STATS
+/* Built in with NED_STATS: frame times, terminal output, main-loop
+ * syscalls and allocations, enough to tell a slow redraw from a slow
+ * buffer or a slow terminal link. Ctrl-T shows them in the message bar,
+ * --stats prints them on exit. */
+
+static double stats_avg(unsigned long long n, unsigned long long per) {
+    return per ? (double)n / (double)per : 0;
+}
+
+// Memory held by the row table: arena slabs, big row chunks, block arrays.
+static size_t stats_row_bytes(void) {
+    size_t n = stats.arena_bytes + stats.chunk_bytes + sizeof(row_block) * (size_t)E.buf->block_capacity;
+    for (int b = 0; b < E.buf->num_blocks; b++) {
+        n += sizeof(editor_row) * (size_t)E.buf->blocks[b].capacity;
+        if (E.buf->blocks[b].offs) n += sizeof(uint32_t) * ((size_t)E.buf->blocks[b].num_rows + 1);
+    }
+    return n;
+}
+
+static const char *stats_size(char *buf, size_t len, double n) {
+    const char *unit = "BKMGT";
+    while (n >= 1024 && unit[1]) { n /= 1024; unit++; }
+    snprintf(buf, len, "%.1f%c", n, *unit);
+    return buf;
+}
+
+static void stats_frame_done(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    unsigned long long ns = (unsigned long long)((t1.tv_sec - t0->tv_sec) * 1000000000LL +
+                                                 (t1.tv_nsec - t0->tv_nsec));
+    stats.frames++;
+    stats.frame_ns += ns;
+    if (ns > stats.frame_max_ns) stats.frame_max_ns = ns;
+}
+
+static int stats_format(char *buf, size_t len) {
+    char out[16], rows[16];
+    return snprintf(buf, len, "frame %.2fms max %.1fms | %s/frame | %.1f sys/key | %.1f alloc/key | rows %s",
+                    stats_avg(stats.frame_ns, stats.frames) / 1e6, (double)stats.frame_max_ns / 1e6,
+                    stats_size(out, sizeof(out), stats_avg(stats.out_bytes, stats.frames)),
+                    stats_avg(stats.syscalls, stats.keys), stats_avg(stats.allocs, stats.keys),
+                    stats_size(rows, sizeof(rows), (double)stats_row_bytes()));
+}
+
+static void stats_dump(void) {
+    char buf[16];
+    fprintf(stderr, "frames        %llu, avg %.3f ms, max %.3f ms\n", stats.frames,
+            stats_avg(stats.frame_ns, stats.frames) / 1e6, (double)stats.frame_max_ns / 1e6);
+    fprintf(stderr, "terminal out  %llu bytes, %s per frame\n", stats.out_bytes,
+            stats_size(buf, sizeof(buf), stats_avg(stats.out_bytes, stats.frames)));
+    fprintf(stderr, "keys          %llu\n", stats.keys);
+    fprintf(stderr, "syscalls      %llu, %.1f per key\n", stats.syscalls, stats_avg(stats.syscalls, stats.keys));
+    fprintf(stderr, "allocations   %llu, %.1f per key\n", stats.allocs, stats_avg(stats.allocs, stats.keys));
+    fprintf(stderr, "row storage   %s\n", stats_size(buf, sizeof(buf), (double)stats_row_bytes()));
+}
+#endif
+
+/* ---------- Prompt ---------- */
+
+/* A one-line prompt in the message bar for commands that need an argument
+ * (Ctrl-O, Ctrl-G). Enter hands the text to the command, Esc drops it.
+ * The search keeps its own prompt, as it acts on every key. */
+static struct {
+    bool active;
+    const char *label;
+    char text[MAX_FILENAME];
+    size_t len;
+    void (*done)(const char *text);
+} prompt;
+
+static void prompt_start(const char *label, void (*done)(const char *text)) {
+    prompt.active = true;
+    prompt.label = label;
+    prompt.len = 0;
+    prompt.text[0] = '\0';
+    prompt.done = done;
+    request_redraw();
+}
+
+static void prompt_append(const char *s, size_t n) {
+    for (size_t i = 0; i < n && prompt.len < sizeof(prompt.text) - 1; i++) {
+        if ((unsigned char)s[i] < 32 || s[i] == 127) continue;
+        prompt.text[prompt.len++] = s[i];
+    }
+    prompt.text[prompt.len] = '\0';
+}
+
+static void prompt_key(int k) {
+    request_redraw();
+    switch (k) {
+        case '\r':
+            prompt.active = false;
+            if (prompt.len) prompt.done(prompt.text);
+            break;
+        case '\x1b':
+            prompt.active = false;
+            break;
+        case 127: case 8:
+            if (prompt.len == 0) break;
+            prompt.len--;
+            while (prompt.len > 0 && ((unsigned char)prompt.text[prompt.len] & 0xc0) == 0x80)
+                prompt.len--;
+            prompt.text[prompt.len] = '\0';
+            break;
+        default:
+            if ((k >= 32 && k < 127) || (k >= 128 && k < 256)) { char c = (char)k; prompt_append(&c, 1); }
+            break;
+    }
+}
+
+/* ---------- Buffers ---------- */
+
+/* Every file opened (on the command line or with Ctrl-O) gets a buffer of
+ * its own; Ctrl-N and Ctrl-P cycle through them. A buffer keeps its rows,
+ * cursor, view, undo and journal, so switching is a pointer change. The
+ * row arena, the render cache and mappings of the same file are shared. */
+
+// A new empty buffer at the end of the list; E.buf is left alone.
+static struct editor_buffer *buffer_new(void) {
+    struct editor_buffer *b = calloc(1, sizeof(*b));
+    if (!b) die("calloc");
+    b->block_index_stale = true;
+    b->cache_block = -1;
+    b->journal.fd = -1;
+    b->journal.off = true;      // until journal_open() names a file for it
+    struct editor_buffer **v = realloc(E.buffers, sizeof(*v) * (size_t)(E.num_buffers + 1));
+    if (!v) die("realloc");
+    E.buffers = v;
+    E.buffers[E.num_buffers++] = b;
+    return b;
+}
+
+static int buffer_number(void) {
+    for (int i = 0; i < E.num_buffers; i++)
+        if (E.buffers[i] == E.buf) return i;
+    return 0;
+}
+
+// Show the buffer `step` places further on, wrapping around the list.
+static void buffer_cycle(int step) {
+    if (E.num_buffers < 2) { set_status_message("No other buffer"); return; }
+    int i = ((buffer_number() + step) % E.num_buffers + E.num_buffers) % E.num_buffers;
+    E.buf = E.buffers[i];
+    request_redraw();
+    set_status_message("Buffer %d/%d: %s", i + 1, E.num_buffers,
+                       E.buf->filename[0] ? E.buf->filename : "[No Name]");
+}
+
+static void buffer_open(const char *path) {
+    E.buf = buffer_new();
+    open_file(path);
+}
+
+/* ---------- Navigation ---------- */
+
+/* Jumps go straight to their line through the block index, so only the
+ * block around the target is looked at, however far into the file it is.
+ * Bookmarks are line numbers kept with the buffer (see the Row table
+ * section for how they follow inserted and deleted lines). */
+
+// Put the cursor at the start of line y, in the middle of the screen
+// unless it is on screen already.
+static void view_jump(int y) {
+    int text_rows = E.screen_rows - 2;
+    if (y >= E.buf->num_rows) y = E.buf->num_rows ? E.buf->num_rows - 1 : 0;
+    if (y < 0) y = 0;
+    E.buf->cursor_y = y;
+    E.buf->cursor_x = 0;
+    if (y < E.buf->row_offset || y >= E.buf->row_offset + text_rows) {
+        E.buf->row_offset = y > text_rows / 2 ? y - text_rows / 2 : 0;
+        E.buf->wrap_offset = 0;
+    }
+    request_redraw();
+}
+
+// Prompt callback: a line number, or a percentage of the file with '%'.
+static void goto_line(const char *text) {
+    char *end;
+    long n = strtol(text, &end, 10);
+    bool percent = *end == '%';
+    if (end == text || (*end && !(percent && !end[1])) || n < 0 || (percent && n > 100)) {
+        set_status_message("Not a line number: %s", text);
+        return;
+    }
+    long y = percent ? (long)((double)E.buf->num_rows * (double)n / 100.0) : n - 1;
+    if (E.buf->index && !percent && y >= E.buf->num_rows)
+        set_status_message("Only %d lines indexed so far", E.buf->num_rows);
+    view_jump(y > INT_MAX ? INT_MAX : (int)y);
+}
+
+static void editor_page(int key) {
+    int text_rows = E.screen_rows - 2, last = E.buf->num_rows ? E.buf->num_rows - 1 : 0;
+    int d = key == PAGE_UP ? -text_rows : text_rows;
+    E.buf->cursor_y = E.buf->cursor_y + d < 0 ? 0 : E.buf->cursor_y + d > last ? last : E.buf->cursor_y + d;
+    E.buf->row_offset = E.buf->row_offset + d < 0 ? 0 : E.buf->row_offset + d > last ? last : E.buf->row_offset + d;
+    E.buf->wrap_offset = 0;
+    if (E.buf->cursor_y < E.buf->num_rows && E.buf->cursor_x > (int)row_length(E.buf->cursor_y))
+        E.buf->cursor_x = (int)row_length(E.buf->cursor_y);
+}
+
+static void editor_home_end(int key) {
+    E.buf->cursor_x = key == END_KEY && E.buf->cursor_y < E.buf->num_rows ? (int)row_length(E.buf->cursor_y) : 0;
+}
+
+// Set or clear the bookmark on the cursor line.
+static void bookmark_toggle(void) {
+    struct editor_buffer *b = E.buf;
+    int y = b->cursor_y, i = 0;
+    while (i < b->num_marks && b->marks[i] < y) i++;
+    if (i < b->num_marks && b->marks[i] == y) {
+        memmove(&b->marks[i], &b->marks[i + 1], sizeof(int) * (size_t)(b->num_marks - i - 1));
+        b->num_marks--;
+        set_status_message("Bookmark cleared (%d left)", b->num_marks);
+        return;
+    }
+    if (b->num_marks == b->marks_cap) {
+        int cap = b->marks_cap ? b->marks_cap * 2 : 8;
+        int *m = realloc(b->marks, sizeof(int) * (size_t)cap);
+        if (!m) die("realloc");
+        b->marks = m;
+        b->marks_cap = cap;
+    }
+    memmove(&b->marks[i + 1], &b->marks[i], sizeof(int) * (size_t)(b->num_marks - i));
+    b->marks[i] = y;
+    b->num_marks++;
+    set_status_message("Bookmark set at line %d (%d in all)", y + 1, b->num_marks);
+}
+
+// Go to the next bookmark below the cursor, or round to the first one.
+static void bookmark_next(void) {
+    struct editor_buffer *b = E.buf;
+    if (!b->num_marks) { set_status_message("No bookmarks (Ctrl-B sets one)"); return; }
+    int i = 0;
+    while (i < b->num_marks && b->marks[i] <= b->cursor_y) i++;
+    if (i == b->num_marks) i = 0;
+    view_jump(b->marks[i]);
+    set_status_message("Bookmark %d/%d: line %d", i + 1, b->num_marks, b->marks[i] + 1);
+}
+
+/* ---------- Highlighting ---------- */
+
+/* C-family files are highlighted. The only state a line hands to the next
+ * is whether it ends inside a block comment; it is kept per row (see the
+ * Row table section), so a row is tokenized from the state the row above
+ * ends in, never from the top of the file. After an edit the rows from
+ * the changed one are tokenized again until one ends in the state it had
+ * before; from there on the old states still hold. Rows near the screen
+ * are brought up to date as they are drawn (at most HL_SYNC_ROWS of them),
+ * the rest in slices of HL_SLICE_ROWS run from the event loop, with keys
+ * handled in between. A row further on is drawn from the state it had
+ * last (or as plain code) until the slices get there. The colored spans
+ * of the rows on screen live in the render cache. */
+
+struct syntax {
+    const char *name;
+    const char *const *exts;        // file name endings
+    const char *const *keywords;
+    const char *const *types;
+};
+
+static const char *const c_exts[] = { ".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp", ".hxx", NULL };
+static const char *const c_keywords[] = {
+    "auto", "break", "case", "catch", "class", "const", "constexpr", "continue", "default",
+    "delete", "do", "else", "enum", "extern", "for", "friend", "goto", "if", "inline",
+    "namespace", "new", "noexcept", "nullptr", "operator", "private", "protected", "public",
+    "register", "restrict", "return", "sizeof", "static", "static_assert", "struct", "switch",
+    "template", "this", "throw", "try", "typedef", "typename", "union", "using", "virtual",
+    "volatile", "while", "NULL", "true", "false", NULL
+};
+static const char *const c_types[] = {
+    "bool", "char", "double", "float", "int", "long", "short", "signed", "unsigned", "void",
+    "size_t", "ssize_t", "off_t", "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t",
+    "uint16_t", "uint32_t", "uint64_t", "intptr_t", "uintptr_t", "wchar_t", NULL
+};
+
+static const struct syntax syntaxes[] = {
+    { "C", c_exts, c_keywords, c_types },
+};
+
+// What a span is drawn as
+enum hl_class { HL_NONE, HL_COMMENT, HL_KEYWORD, HL_TYPE, HL_STRING, HL_NUMBER, HL_PREPROC };
+
+static const char *const hl_colors[] = {
+    [HL_COMMENT] = "\x1b[36m", [HL_KEYWORD] = "\x1b[33m", [HL_TYPE] = "\x1b[32m",
+    [HL_STRING] = "\x1b[35m", [HL_NUMBER] = "\x1b[31m", [HL_PREPROC] = "\x1b[34m",
+};
+
+struct hl_span { size_t start, end; int cls; };     // bytes of the row
+
+struct hl_spans {
+    struct hl_span *v;
+    size_t n, cap;
+};
+
+static void hl_add(struct hl_spans *out, size_t start, size_t end, int cls) {
+    if (!out || start == end) return;
+    if (out->n && out->v[out->n - 1].end == start && out->v[out->n - 1].cls == cls) {
+        out->v[out->n - 1].end = end;
+        return;
+    }
+    if (out->n == out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 16;
+        struct hl_span *v = realloc(out->v, sizeof(*v) * cap);
+        if (!v) die("realloc");
+        out->v = v;
+        out->cap = cap;
+    }
+    out->v[out->n++] = (struct hl_span){ start, end, cls };
+}
+
+static bool hl_ident_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || (unsigned char)c >= 128;
+}
+
+static bool hl_listed(const char *const *list, const char *word, size_t len) {
+    for (; *list; list++)
+        if (strlen(*list) == len && memcmp(*list, word, len) == 0) return true;
+    return false;
+}
+
+// Tokenize a row that starts in `state`; returns the state it ends in.
+// The spans go to `out` unless it is NULL (only the state is wanted).
+static int hl_lex(const editor_row *row, int state, struct hl_spans *out) {
+    const struct syntax *syn = E.buf->syntax;
+    size_t n = row->length, i = 0;
+    bool line_start = true;         // only blanks so far: # starts a directive
+    while (i < n) {
+        size_t start = i;
+        char c = row_char(row, i), next = i + 1 < n ? row_char(row, i + 1) : '\0';
+        if (state == HL_BLOCK_COMMENT || (c == '/' && next == '*')) {
+            if (state != HL_BLOCK_COMMENT) i += 2;
+            state = HL_BLOCK_COMMENT;
+            for (; i < n; i++) {
+                if (row_char(row, i) == '*' && i + 1 < n && row_char(row, i + 1) == '/') {
+                    i += 2;
+                    state = HL_CODE;
+                    break;
+                }
+            }
+            hl_add(out, start, i, HL_COMMENT);
+        } else if (c == '/' && next == '/') {
+            hl_add(out, start, n, HL_COMMENT);
+            i = n;
+        } else if (c == '"' || c == '\'') {
+            for (i++; i < n && row_char(row, i) != c; i++)
+                if (row_char(row, i) == '\\') i++;
+            i = i < n ? i + 1 : n;
+            hl_add(out, start, i, HL_STRING);
+        } else if (c == '#' && line_start) {
+            for (i++; i < n && (row_char(row, i) == ' ' || row_char(row, i) == '\t'); i++) {}
+            while (i < n && hl_ident_char(row_char(row, i))) i++;
+            hl_add(out, start, i, HL_PREPROC);
+        } else if (isdigit((unsigned char)c) || (c == '.' && isdigit((unsigned char)next))) {
+            while (i < n && (hl_ident_char(row_char(row, i)) || row_char(row, i) == '.')) i++;
+            hl_add(out, start, i, HL_NUMBER);
+        } else if (hl_ident_char(c)) {
+            char word[32];
+            size_t len = 0;
+            for (; i < n && hl_ident_char(row_char(row, i)); i++)
+                if (len < sizeof(word)) word[len++] = row_char(row, i);
+            if (out && i - start == len) {
+                if (hl_listed(syn->keywords, word, len)) hl_add(out, start, i, HL_KEYWORD);
+                else if (hl_listed(syn->types, word, len)) hl_add(out, start, i, HL_TYPE);
+            }
+        } else {
+            i++;
+        }
+        if (c != ' ' && c != '\t') line_start = false;
+    }
+    return state;
+}
+
+// Pick the rules for the buffer's file name; everything is tokenized anew.
+static void hl_select(void) {
+    E.buf->syntax = NULL;
+    E.buf->hl_from = 0;
+    size_t len = strlen(E.buf->filename);
+    for (size_t s = 0; s < sizeof(syntaxes) / sizeof(syntaxes[0]); s++) {
+        for (const char *const *ext = syntaxes[s].exts; *ext; ext++) {
+            size_t k = strlen(*ext);
+            if (len > k && strcmp(E.buf->filename + len - k, *ext) == 0) {
+                E.buf->syntax = &syntaxes[s];
+                return;
+            }
+        }
+    }
+}
+
+// Bring row hl_from up to date. A row that ends in the state it had means
+// the known states after it hold, so the next unknown one is up next.
+static void hl_step(void) {
+    int r = E.buf->hl_from;
+    int in = r ? row_hl(r - 1) : HL_CODE;
+    editor_row row = row_get(r);
+    int out = hl_lex(&row, in == HL_UNKNOWN ? HL_CODE : in, NULL);
+    int old = row_hl(r);
+    row_set_hl(r, out);
+    E.buf->hl_from = out == old ? row_hl_next_unknown(r + 1) : r + 1;
+}
+
+static int hl_timer = -1;
+
+// Timer: tokenize a slice of rows for every buffer that is behind.
+static void hl_on_idle(void) {
+    hl_timer = -1;
+    struct editor_buffer *cur = E.buf;
+    int budget = HL_SLICE_ROWS;
+    bool more = false;
+    for (int i = 0; i < E.num_buffers; i++) {
+        E.buf = E.buffers[i];
+        if (!E.buf->syntax) continue;
+        int first = E.buf->hl_from;
+        while (budget > 0 && E.buf->hl_from < E.buf->num_rows) {
+            hl_step();
+            budget--;
+        }
+        // redraw once the screen can use what was done
+        if (E.buf == cur && first < E.buf->row_offset + E.screen_rows && E.buf->hl_from >= E.buf->row_offset &&
+            first != E.buf->hl_from)
+            request_redraw();
+        more = more || E.buf->hl_from < E.buf->num_rows;
+    }
+    E.buf = cur;
+    if (more) hl_timer = timer_start(0, 0, hl_on_idle);
+}
+
+// There are rows to tokenize: start the slices, HL_IDLE_MS from now.
+static void hl_kick(void) {
+    if (hl_timer < 0) hl_timer = timer_start(HL_IDLE_MS, 0, hl_on_idle);
+}
+
+// The state row r starts in, for drawing it.
+static int hl_start_state(int r) {
+    while (E.buf->hl_from < r && r - E.buf->hl_from <= HL_SYNC_ROWS) hl_step();
+    int state = r ? row_hl(r - 1) : HL_CODE;
+    return state == HL_UNKNOWN ? HL_CODE : state;
+}
+
+/* ---------- Screen drawing ---------- */
+
+struct abuf { char *b; int len; int cap; };
+#define ABUF_INIT {NULL, 0, 0}
+
+// Buffers are reused across frames, so capacity only ever doubles and a
+// steady-state frame does no allocation at all.
+static bool ab_reserve(struct abuf *ab, int n) {
+    if (ab->len + n <= ab->cap) return true;
+    int cap = ab->cap ? ab->cap : 256;
+    while (cap < ab->len + n) cap *= 2;
+    char *p = realloc(ab->b, (size_t)cap);
+    if (!p) return false;
+    STAT_ADD(allocs, 1);
+    ab->b = p; ab->cap = cap;
+    return true;
+}
+
+static void ab_append(struct abuf *ab, const char *s, int len) {
+    if (len <= 0 || !ab_reserve(ab, len)) return;
+    memcpy(ab->b + ab->len, s, (size_t)len);
+    ab->len += len;
+}
+
+static void ab_fill(struct abuf *ab, char c, int n) {
+    if (n <= 0 || !ab_reserve(ab, n)) return;
+    memset(ab->b + ab->len, c, (size_t)n);
+    ab->len += n;
+}
+
+static void ab_free(struct abuf *ab) { free(ab->b); ab->b = NULL; ab->len = ab->cap = 0; }
+
+// Append up to n bytes of a row starting at byte `from`, reading straight
+// from both sides of the gap so drawing never has to collapse it.
+static void ab_append_row(struct abuf *ab, const editor_row *row, size_t from, size_t n) {
+    const char *a, *b;
+    size_t alen, blen;
+    row_runs(row, &a, &alen, &b, &blen);
+    if (from < alen) {
+        size_t k = alen - from < n ? alen - from : n;
+        ab_append(ab, a + from, (int)k);
+        n -= k;
+        from = alen;
+    }
+    from -= alen;
+    if (n && from < blen) ab_append(ab, b + from, (int)(blen - from < n ? blen - from : n));
+}
+
+/* Tabs are shown expanded to the next TAB_WIDTH stop, control bytes and
+ * malformed UTF-8 as '?', and other characters take the columns given
+ * by cp_width(). The rows on screen keep what that costs in a small cache
+ * keyed by line number and checked against the row's text, length and
+ * edit stamp, so a row is measured again only once it changes:
+ *  - TEXT_PLAIN rows (the vector check in text_class) keep nothing: bytes
+ *    are columns.
+ *  - TEXT_CTRL rows keep their expanded text, indexed by column.
+ *  - TEXT_UTF8 rows are drawn from the row itself.
+ * Both of the latter keep the column of the first character boundary at
+ * or after every RENDER_STEP-th byte, which turns a byte offset into a
+ * column (and back) with a walk of at most one step. All buffers share
+ * the cache: a row borrowed from a shared mapping is the same text in
+ * each of them, an owned row is also checked against its buffer. */
+
+#define RENDER_STEP_SHIFT 6
+#define RENDER_STEP (1u << RENDER_STEP_SHIFT)
+
+struct render_mark { size_t byte, col; };
+
+struct render_row {
+    int filerow;            // -1 while unused
+    const char *chars;      // the row this was built from
+    size_t length;
+    unsigned long stamp;
+    const struct editor_buffer *owner;  // buffer of an owned row, else NULL
+    int kind;               // TEXT_*
+    size_t width;           // columns taken by the whole row
+    char *text;             // expanded TEXT_CTRL row
+    size_t cap;
+    struct render_mark *marks;  // one per RENDER_STEP bytes
+    size_t marks_cap;
+    struct hl_spans hl;         // highlighting, for a row starting in hl_in
+    int hl_in, hl_out;
+    const struct syntax *hl_syntax;
+};
+
+static struct render_row *render_cache;
+static int render_cache_size;   // power of two, at least twice the text area
+
+// Decode the character at byte i for display; *w gets its columns at
+// screen column col and *cp the code point, or -1 when it shows as '?'.
+static size_t render_char(const editor_row *row, size_t i, size_t col, size_t *w, int *cp) {
+    size_t n = row_decode(row, i, cp);
+    if (*cp == '\t') { *w = TAB_WIDTH - col % TAB_WIDTH; return n; }
+    if (*cp < ' ' || (*cp >= 127 && *cp < 0xa0)) { *cp = -1; *w = 1; return n; }
+    *w = (size_t)cp_width(*cp);
+    return n;
+}
+
+static void render_build(struct render_row *rr, const editor_row *row) {
+    const char *a, *b;
+    size_t alen, blen;
+    row_runs(row, &a, &alen, &b, &blen);
+    int ka = text_class(a, alen), kb = ka == TEXT_UTF8 ? ka : text_class(b, blen);
+    rr->kind = ka > kb ? ka : kb;
+    rr->width = row->length;
+    if (rr->kind == TEXT_PLAIN) return;
+
+    size_t nmarks = (row->length >> RENDER_STEP_SHIFT) + 1;
+    if (rr->marks_cap < nmarks) {
+        free(rr->marks);
+        if (!(rr->marks = malloc(nmarks * sizeof *rr->marks))) die("malloc");
+        rr->marks_cap = nmarks;
+    }
+    size_t col = 0, next = 0, i = 0;
+    while (i < row->length) {
+        while (next < nmarks && i >= next << RENDER_STEP_SHIFT)
+            rr->marks[next++] = (struct render_mark){ i, col };
+        size_t w;
+        int cp;
+        size_t n = render_char(row, i, col, &w, &cp);
+        if (rr->kind == TEXT_CTRL) {
+            if (col + w > rr->cap) {
+                size_t cap = rr->cap ? rr->cap * 2 : 256;
+                while (cap < col + w) cap *= 2;
+                char *p = realloc(rr->text, cap);
+                if (!p) die("realloc");
+                rr->text = p; rr->cap = cap;
+            }
+            if (cp == '\t') memset(rr->text + col, ' ', w);
+            else rr->text[col] = cp < 0 ? '?' : (char)cp;
+        }
+        col += w;
+        i += n;
+    }
+    while (next < nmarks) rr->marks[next++] = (struct render_mark){ i, col };
+    rr->width = col;
+}
+
+static struct render_row *render_get(int filerow, const editor_row *row) {
+    if (render_cache_size < 2 * E.screen_rows) {
+        for (int i = 0; i < render_cache_size; i++) {
+            free(render_cache[i].text);
+            free(render_cache[i].marks);
+            free(render_cache[i].hl.v);
+        }
+        free(render_cache);
+        int n = 64;
+        while (n < 2 * E.screen_rows) n *= 2;
+        if (!(render_cache = calloc((size_t)n, sizeof *render_cache))) die("calloc");
+        for (int i = 0; i < n; i++) render_cache[i].filerow = -1;
+        render_cache_size = n;
+    }
+    struct render_row *rr = &render_cache[filerow & (render_cache_size - 1)];
+    unsigned long stamp = row->capacity ? row->stamp : 0;
+    const struct editor_buffer *owner = row->capacity ? E.buf : NULL;
+    if (rr->filerow != filerow || rr->chars != row->chars ||
+        rr->length != row->length || rr->stamp != stamp || rr->owner != owner) {
+        render_build(rr, row);
+        rr->filerow = filerow;
+        rr->chars = row->chars;
+        rr->length = row->length;
+        rr->stamp = stamp;
+        rr->owner = owner;
+        rr->hl_in = HL_UNKNOWN;
+    }
+    return rr;
+}
+
+// Tokenize a cached row that starts in `state`, unless that is done.
+static void render_highlight(struct render_row *rr, const editor_row *row, int state) {
+    if (rr->hl_in == state && rr->hl_syntax == E.buf->syntax) return;
+    rr->hl.n = 0;
+    rr->hl_out = hl_lex(row, state, &rr->hl);
+    rr->hl_in = state;
+    rr->hl_syntax = E.buf->syntax;
+}
+
+// Last mark at or before screen column col.
+static const struct render_mark *render_mark_at(const struct render_row *rr, size_t col) {
+    size_t lo = 0, hi = rr->length >> RENDER_STEP_SHIFT;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (rr->marks[mid].col <= col) lo = mid; else hi = mid - 1;
+    }
+    return &rr->marks[lo];
+}
+
+// Screen column of byte cx.
+static size_t render_col(const struct render_row *rr, const editor_row *row, size_t cx) {
+    if (rr->kind == TEXT_PLAIN) return cx;
+    if (cx > row->length) cx = row->length;
+    size_t k = cx >> RENDER_STEP_SHIFT;
+    while (k && rr->marks[k].byte > cx) k--;
+    size_t i = rr->marks[k].byte, col = rr->marks[k].col, w;
+    int cp;
+    while (i < cx) {
+        i += render_char(row, i, col, &w, &cp);
+        col += w;
+    }
+    return col;
+}
+
+// Start of the character shown at screen column col.
+static size_t render_byte(const struct render_row *rr, const editor_row *row, size_t col) {
+    if (rr->kind == TEXT_PLAIN) return col < row->length ? col : row->length;
+    const struct render_mark *m = render_mark_at(rr, col);
+    size_t i = m->byte, c = m->col, w;
+    int cp;
+    while (i < row->length) {
+        size_t n = render_char(row, i, c, &w, &cp);
+        if (c + w > col) break;
+        c += w;
+        i += n;
+    }
+    return i;
+}
+
+// Screen lines a row takes when wrapped; there is always room for the
+// cursor after the last character.
+static size_t render_lines(const struct render_row *rr) {
+    return rr->width / (size_t)E.screen_cols + 1;
+}
+
+static size_t row_screen_lines(int filerow) {
+    if (filerow >= E.buf->num_rows) return 1;
+    editor_row row = row_get(filerow);
+    return render_lines(render_get(filerow, &row));
+}
+
+// Append n screen columns of a row starting at column `from`.
+static void ab_append_cols(struct abuf *ab, const editor_row *row,
+                           const struct render_row *rr, size_t from, size_t n) {
+    if (rr->kind == TEXT_PLAIN) { ab_append_row(ab, row, from, n); return; }
+    if (rr->kind == TEXT_CTRL) {
+        if (from < rr->width)
+            ab_append(ab, rr->text + from, (int)(rr->width - from < n ? rr->width - from : n));
+        return;
+    }
+
+    // characters cut by either edge are shown as blanks
+    size_t end = from + n, w;
+    const struct render_mark *m = render_mark_at(rr, from);
+    size_t i = m->byte, c = m->col;
+    int cp;
+    while (i < row->length && c < end) {
+        size_t len = render_char(row, i, c, &w, &cp);
+        if (c + w > from || (w == 0 && c > from)) {
+            if (c < from || c + w > end || cp == '\t') {
+                size_t s = c < from ? from : c, e = c + w > end ? end : c + w;
+                ab_fill(ab, ' ', (int)(e - s));
+            } else if (cp < 0) {
+                ab_append(ab, "?", 1);
+            } else {
+                for (size_t k = 0; k < len; k++) {
+                    char ch = row_char(row, i + k);
+                    ab_append(ab, &ch, 1);
+                }
+            }
+        }
+        c += w;
+        i += len;
+    }
+}
+
+// With soft wrap the view starts at screen line wrap_offset of row_offset.
+// Only the rows between there and the cursor are looked at, so moving
+// around never rewraps anything outside the window.
+static void editor_scroll_wrap(void) {
+    size_t text_rows = (size_t)(E.screen_rows - 2), cols = (size_t)E.screen_cols;
+    size_t sub = (size_t)E.render_x / cols;
+    E.buf->col_offset = 0;
+    E.render_x %= E.screen_cols;
+    if (E.buf->row_offset >= E.buf->num_rows) E.buf->row_offset = E.buf->num_rows ? E.buf->num_rows - 1 : 0;
+    size_t top = row_screen_lines(E.buf->row_offset);
+    if (E.buf->wrap_offset >= top) E.buf->wrap_offset = top - 1;
+
+    if (E.buf->cursor_y < E.buf->row_offset || (E.buf->cursor_y == E.buf->row_offset && sub < E.buf->wrap_offset)) {
+        E.buf->row_offset = E.buf->cursor_y;
+        E.buf->wrap_offset = sub;
+        E.render_y = 0;
+        return;
+    }
+
+    // screen lines from the top of the view down to the cursor
+    size_t n;
+    if (E.buf->cursor_y == E.buf->row_offset) {
+        n = sub - E.buf->wrap_offset;
+    } else {
+        n = top - E.buf->wrap_offset;
+        for (int y = E.buf->row_offset + 1; y < E.buf->cursor_y && n < text_rows; y++)
+            n += row_screen_lines(y);
+        n += sub;
+    }
+    if (n < text_rows) { E.render_y = (int)n; return; }
+
+    // put the cursor on the last line
+    size_t need = text_rows - 1;
+    int y = E.buf->cursor_y;
+    E.render_y = (int)need;
+    if (sub >= need) { E.buf->row_offset = y; E.buf->wrap_offset = sub - need; return; }
+    need -= sub;
+    while (y > 0) {
+        size_t lines = row_screen_lines(--y);
+        if (lines >= need) { E.buf->row_offset = y; E.buf->wrap_offset = lines - need; return; }
+        need -= lines;
+    }
+    E.buf->row_offset = 0;
+    E.buf->wrap_offset = 0;
+    E.render_y -= (int)need;
+}
+
+static void editor_scroll(void) {
+    E.render_x = E.buf->cursor_x;
+    if (E.buf->cursor_y < E.buf->num_rows) {
+        editor_row row = row_get(E.buf->cursor_y);
+        E.render_x = (int)render_col(render_get(E.buf->cursor_y, &row), &row, (size_t)E.buf->cursor_x);
+    }
+    if (E.buf->wrap) { editor_scroll_wrap(); return; }
+
+    if (E.buf->cursor_y < E.buf->row_offset) E.buf->row_offset = E.buf->cursor_y;
+    if (E.buf->cursor_y >= E.buf->row_offset + (E.screen_rows - 2))
+        E.buf->row_offset = E.buf->cursor_y - (E.screen_rows - 2) + 1;
+    E.render_y = E.buf->cursor_y - E.buf->row_offset;
+
+    if (E.render_x < E.buf->col_offset) E.buf->col_offset = E.render_x;
+    if (E.render_x >= E.buf->col_offset + E.screen_cols)
+        E.buf->col_offset = E.render_x - E.screen_cols + 1;
+    E.render_x -= E.buf->col_offset;
+}
+
+/* The frame currently on the terminal, one line per screen row, so a new
+ * frame only sends what changed. A line with len < 0 is unknown and is
+ * redrawn in full. */
+static struct abuf *frame;
+static int frame_rows, frame_cols;
+static int frame_row_offset;
+static const struct editor_buffer *frame_buf;   // the buffer the frame shows
+static struct abuf frame_line;      // scratch for the line being built
+static struct abuf frame_out;       // escape stream for the whole frame
+
+static void frame_reset(struct abuf *ab) {
+    for (int y = 0; y < frame_rows; y++) ab_free(&frame[y]);
+    free(frame);
+    frame_rows = E.screen_rows;
+    frame_cols = E.screen_cols;
+    frame = calloc((size_t)frame_rows, sizeof(struct abuf));
+    if (!frame) die("calloc");
+    for (int y = 0; y < frame_rows; y++) frame[y].len = -1;
+    // a full repaint is the largest frame we send; size for it up front
+    ab_reserve(ab, E.screen_rows * (E.screen_cols + 16));
+    frame_row_offset = E.buf->row_offset;
+    ab_append(ab, "\x1b[2J", 4);
+}
+
+// When the view moved by a few lines, scroll the text area with a scroll
+// region (LF at the bottom margin / RI at the top) instead of repainting,
+// and shift the retained frame to match what the terminal now shows.
+static void frame_scroll(struct abuf *ab) {
+    int text_rows = E.screen_rows - 2;
+    int d = frame_buf == E.buf ? E.buf->row_offset - frame_row_offset : 0;
+    frame_row_offset = E.buf->row_offset;
+    frame_buf = E.buf;
+    if (E.buf->wrap) return;     // rows are not lines; the line diff still applies
+    if (d == 0 || d >= text_rows || -d >= text_rows) return;
+
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d;1H", text_rows, d > 0 ? text_rows : 1);
+    ab_append(ab, buf, n);
+    for (int i = 0; i < (d > 0 ? d : -d); i++) ab_append(ab, d > 0 ? "\n" : "\x1bM", d > 0 ? 1 : 2);
+    ab_append(ab, "\x1b[r", 3);
+
+    struct abuf tmp;
+    if (d > 0) {
+        for (int y = 0; y < text_rows; y++) {
+            if (y + d < text_rows) { tmp = frame[y]; frame[y] = frame[y + d]; frame[y + d] = tmp; }
+            else frame[y].len = 0;   // scrolled in blank
+        }
+    } else {
+        for (int y = text_rows - 1; y >= 0; y--) {
+            if (y + d >= 0) { tmp = frame[y]; frame[y] = frame[y + d]; frame[y + d] = tmp; }
+            else frame[y].len = 0;
+        }
+    }
+}
+
+// Emit screen line y if it differs from what is shown. Only the part after
+// the longest common prefix of plain printable ASCII (where bytes map 1:1
+// to columns) is rewritten; the line is cleared before writing, so a full
+// width line never trips the pending-wrap state on the last column.
+static void frame_update_line(struct abuf *ab, int y, const struct abuf *line) {
+    struct abuf *old = &frame[y];
+    if (old->len == line->len && (line->len == 0 || memcmp(old->b, line->b, (size_t)line->len) == 0))
+        return;
+
+    int p = 0;
+    if (old->len > 0) {
+        int max = old->len < line->len ? old->len : line->len;
+        while (p < max && old->b[p] == line->b[p] &&
+               (unsigned char)line->b[p] >= 32 && (unsigned char)line->b[p] < 127) p++;
+    }
+    char pos[32];
+    int n = snprintf(pos, sizeof(pos), "\x1b[%d;%dH\x1b[K", y + 1, p + 1);
+    ab_append(ab, pos, n);
+    ab_append(ab, line->b + p, line->len - p);
+
+    old->len = 0;
+    ab_append(old, line->b, line->len);
+}
+
+// Draw the visible part of a row with the search matches in reverse video.
+static void draw_row_matches(struct abuf *ab, const editor_row *row,
+                             const struct render_row *rr, int filerow, size_t c) {
+    size_t end = c + (size_t)E.screen_cols;
+    size_t from = render_byte(rr, row, c);
+    struct search_job *job = search.job;
+    // a match starting this far left may still reach into view
+    size_t back = job->re ? from : job->sr.len - 1;
+    pthread_mutex_lock(&job->lock);
+    for (int i = 0; i < job->nbuckets; i++) {
+        struct search_bucket *bk = &job->buckets[i];
+        if (filerow < bk->first_line || filerow >= bk->end_line) continue;
+        size_t j = hits_lower_bound(bk->hits, bk->count, filerow, from > back ? from - back : 0);
+        for (; j < bk->count && bk->hits[j].y == filerow; j++) {
+            size_t s = render_col(rr, row, bk->hits[j].x);
+            if (s >= end) break;
+            size_t e = render_col(rr, row, bk->hits[j].x + bk->hits[j].len);
+            if (s < c) s = c;
+            if (e > end) e = end;
+            if (e <= s) continue;
+            ab_append_cols(ab, row, rr, c, s - c);
+            ab_append(ab, "\x1b[7m", 4);
+            ab_append_cols(ab, row, rr, s, e - s);
+            ab_append(ab, "\x1b[m", 3);
+            c = e;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&job->lock);
+    ab_append_cols(ab, row, rr, c, end - c);
+}
+
+// Draw a row from column c in its highlighting colors.
+static void draw_row_syntax(struct abuf *ab, const editor_row *row,
+                            const struct render_row *rr, size_t c) {
+    size_t end = c + (size_t)E.screen_cols;
+    size_t from = render_byte(rr, row, c);
+    // skip the spans that end left of the view
+    size_t lo = 0, hi = rr->hl.n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (rr->hl.v[mid].end <= from) lo = mid + 1;
+        else hi = mid;
+    }
+    for (size_t i = lo; i < rr->hl.n; i++) {
+        const struct hl_span *sp = &rr->hl.v[i];
+        size_t s = render_col(rr, row, sp->start);
+        if (s >= end) break;
+        size_t e = render_col(rr, row, sp->end);
+        if (s < c) s = c;
+        if (e > end) e = end;
+        if (e <= s) continue;
+        ab_append_cols(ab, row, rr, c, s - c);
+        ab_append(ab, hl_colors[sp->cls], (int)strlen(hl_colors[sp->cls]));
+        ab_append_cols(ab, row, rr, s, e - s);
+        ab_append(ab, "\x1b[39m", 5);
+        c = e;
+    }
+    ab_append_cols(ab, row, rr, c, end - c);
+}
+
+static void draw_rows(struct abuf *ab) {
+    int text_rows = E.screen_rows - 2;
+    int filerow = E.buf->row_offset;
+    size_t sub = E.buf->wrap ? E.buf->wrap_offset : 0;
+    // search matches are shown instead of the highlighting
+    bool syntax = E.buf->syntax && !search.job;
+    int state = syntax && filerow < E.buf->num_rows ? hl_start_state(filerow) : HL_CODE;
+    for (int y = 0; y < text_rows; y++) {
+        frame_line.len = 0;
+        if (filerow >= E.buf->num_rows)
+            ab_append(&frame_line, "~", 1);
+        else {
+            editor_row row = row_get(filerow);
+            struct render_row *rr = render_get(filerow, &row);
+            size_t c = E.buf->wrap ? sub * (size_t)E.screen_cols : (size_t)E.buf->col_offset;
+            if (syntax) render_highlight(rr, &row, state);
+            if (search.job) draw_row_matches(&frame_line, &row, rr, filerow, c);
+            else if (syntax) draw_row_syntax(&frame_line, &row, rr, c);
+            else ab_append_cols(&frame_line, &row, rr, c, (size_t)E.screen_cols);
+            if (!E.buf->wrap || ++sub == render_lines(rr)) sub = 0;
+            if (sub == 0) state = rr->hl_out;
+        }
+        if (sub == 0) filerow++;
+        frame_update_line(ab, y, &frame_line);
+    }
+    if (E.buf->syntax && E.buf->hl_from < E.buf->num_rows) hl_kick();
+}
+
+static void draw_status_bar(struct abuf *ab) {
+    frame_line.len = 0;
+    ab_append(&frame_line, "\x1b[7m", 4);
+    char status[160], number[32] = "";
+    if (E.num_buffers > 1) snprintf(number, sizeof(number), "[%d/%d] ", buffer_number() + 1, E.num_buffers);
+    int len = snprintf(status, sizeof(status), "%s[%s] %s%s%s%s%s", number,
+        E.buf->filename[0] ? E.buf->filename : "[No Name]",
+        E.buf->modified ? "*" : "",
+        E.buf->index ? " indexing..." : "",
+        stream.fd >= 0 && stream.dest == E.buf ? " reading..." : "",
+        E.buf->read_only ? " [follow]" : "",
+        E.buf->changed_on_disk ? " [changed on disk]" : "");
+    char pos[48];
+    int plen = snprintf(pos, sizeof(pos), "%d/%d", E.buf->cursor_y + 1, E.buf->num_rows);
+    if (len > E.screen_cols) len = E.screen_cols;
+    ab_append(&frame_line, status, len);
+    if (len + plen + 1 <= E.screen_cols) {
+        ab_fill(&frame_line, ' ', E.screen_cols - len - plen);
+        ab_append(&frame_line, pos, plen);
+    } else {
+        ab_fill(&frame_line, ' ', E.screen_cols - len);
+    }
+    ab_append(&frame_line, "\x1b[m", 3);
+    frame_update_line(ab, E.screen_rows - 2, &frame_line);
+}
+
+static void draw_message_bar(struct abuf *ab) {
+    frame_line.len = 0;
+    if (search.active) {
+        char prompt[160], count[48] = "";
+        if (search.bad_regex) snprintf(count, sizeof(count), " [bad regex]");
+        if (search.job) {
+            bool running;
+            size_t n = search_count(&running);
+            // a pending move with the search done waits for the indexer
+            snprintf(count, sizeof(count), running ? " [%zu matches, searching...]" :
+                     search.pending && E.buf->index ? " [%zu matches, indexing...]" :
+                     n ? " [%zu matches]" : " [no match]", n);
+        }
+        int len = snprintf(prompt, sizeof(prompt), "%s: %s%s (Esc/Enter/Arrows/Ctrl-R)",
+                           search.regex ? "Regex" : "Search", search.query, count);
+        if (len > E.screen_cols) len = E.screen_cols;
+        ab_append(&frame_line, prompt, len);
+        frame_update_line(ab, E.screen_rows - 1, &frame_line);
+        return;
+    }
+    if (prompt.active) {
+        char line[MAX_FILENAME + 48];
+        int len = snprintf(line, sizeof(line), "%s: %s (Esc to cancel)", prompt.label, prompt.text);
+        if (len > E.screen_cols) len = E.screen_cols;
+        ab_append(&frame_line, line, len);
+        frame_update_line(ab, E.screen_rows - 1, &frame_line);
+        return;
+    }
+#if NED_STATS
+    if (stats.show) {
+        char line[160];
+        int len = stats_format(line, sizeof(line));
+        if (len > E.screen_cols) len = E.screen_cols;
+        ab_append(&frame_line, line, len);
+        frame_update_line(ab, E.screen_rows - 1, &frame_line);
+        return;
+    }
+#endif
+    int msglen = (int)strlen(E.status_msg);
+    if (msglen > E.screen_cols) msglen = E.screen_cols;
+    if (msglen > 0) ab_append(&frame_line, E.status_msg, msglen);
+    frame_update_line(ab, E.screen_rows - 1, &frame_line);
+}
+
+static void refresh_screen(void) {
+#if NED_STATS
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+#endif
+    editor_scroll();
+    struct abuf *ab = &frame_out;
+    ab->len = 0;
+    ab_append(ab, "\x1b[?25l", 6);           // hide cursor
+    if (!frame || frame_rows != E.screen_rows || frame_cols != E.screen_cols)
+        frame_reset(ab);
+    else
+        frame_scroll(ab);
+    draw_rows(ab);
+    draw_status_bar(ab);
+    draw_message_bar(ab);
+
+    // place cursor
+    int cy = E.render_y + 1;
+    int cx = E.render_x + 1;
+    if (cy < 1) cy = 1;
+    if (cx < 1) cx = 1;
+    char pos[32];
+    int n = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", cy, cx);
+    ab_append(ab, pos, n);
+    ab_append(ab, "\x1b[?25h", 6);          // show cursor
+
+    wrlit(ab->b, (size_t)ab->len);
+#if NED_STATS
+    stats_frame_done(&t0);
+#endif
+}
+
+static int status_timer = -1;
+
+static void clear_status_message(void) {
+    status_timer = -1;
+    E.status_msg[0] = '\0';
+    request_redraw();
+}
+
+static void set_status_message(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.status_msg, sizeof(E.status_msg), fmt, ap);
+    va_end(ap);
+    timer_stop(status_timer);
+    status_timer = timer_start(MESSAGE_TIMEOUT_MS, 0, clear_status_message);
+    request_redraw();
+}
+
+/* ---------- Input ---------- */
+
+// Up/down with soft wrap: go to the same column on the next screen line,
+// which may still be in the same row.
+static void editor_move_wrapped(int key) {
+    size_t cols = (size_t)E.screen_cols;
+    editor_row row = row_get(E.buf->cursor_y);
+    struct render_row *rr = render_get(E.buf->cursor_y, &row);
+    size_t rx = render_col(rr, &row, (size_t)E.buf->cursor_x);
+    size_t sub = rx / cols, col = rx % cols;
+    if (key == ARROW_UP) {
+        if (sub > 0) {
+            sub--;
+        } else if (E.buf->cursor_y > 0) {
+            E.buf->cursor_y--;
+            row = row_get(E.buf->cursor_y);
+            rr = render_get(E.buf->cursor_y, &row);
+            sub = render_lines(rr) - 1;
+        } else {
+            return;
+        }
+    } else {
+        if (sub + 1 < render_lines(rr)) {
+            sub++;
+        } else if (E.buf->cursor_y < E.buf->num_rows - 1) {
+            E.buf->cursor_y++;
+            row = row_get(E.buf->cursor_y);
+            rr = render_get(E.buf->cursor_y, &row);
+            sub = 0;
+        } else {
+            return;
+        }
+    }
+    E.buf->cursor_x = (int)render_byte(rr, &row, sub * cols + col);
+}
+
+static void editor_move_cursor(int key) {
+    if (E.buf->num_rows == 0) return;
+    if (E.buf->wrap && E.buf->cursor_y < E.buf->num_rows && (key == ARROW_UP || key == ARROW_DOWN)) {
+        editor_move_wrapped(key);
+        return;
+    }
+    editor_row row;
+    int rowlen = -1;
+    if (E.buf->cursor_y < E.buf->num_rows) {
+        row = row_get(E.buf->cursor_y);
+        rowlen = (int)row.length;
+    }
+
+    switch (key) {
+        case ARROW_UP:
+        case ARROW_DOWN: {
+            if (key == ARROW_UP ? E.buf->cursor_y == 0 : E.buf->cursor_y >= E.buf->num_rows - 1) break;
+            // keep the screen column, not the byte offset
+            size_t col = rowlen < 0 ? 0 : render_col(render_get(E.buf->cursor_y, &row), &row, (size_t)E.buf->cursor_x);
+            E.buf->cursor_y += key == ARROW_UP ? -1 : 1;
+            row = row_get(E.buf->cursor_y);
+            E.buf->cursor_x = (int)render_byte(render_get(E.buf->cursor_y, &row), &row, col);
+            break;
+        }
+        case ARROW_LEFT:
+            if (E.buf->cursor_x > 0) E.buf->cursor_x = (int)row_prev_char(&row, (size_t)E.buf->cursor_x);
+            else if (E.buf->cursor_y > 0) { E.buf->cursor_y--; E.buf->cursor_x = (int)row_length(E.buf->cursor_y); }
+            break;
+        case ARROW_RIGHT:
+            if (rowlen >= 0 && E.buf->cursor_x < rowlen) E.buf->cursor_x = (int)row_next_char(&row, (size_t)E.buf->cursor_x);
+            else if (E.buf->cursor_y < E.buf->num_rows - 1) { E.buf->cursor_y++; E.buf->cursor_x = 0; }
+            break;
+    }
+    rowlen = (E.buf->cursor_y >= E.buf->num_rows) ? 0 : (int)row_length(E.buf->cursor_y);
+    if (E.buf->cursor_x > rowlen) E.buf->cursor_x = rowlen;
+}
+
+/* Terminal input is read in large chunks into inbuf and decoded from
+ * there, instead of one read() per byte. */
+static unsigned char inbuf[BUFFER_SIZE];
+static size_t in_head, in_len;
+
+static bool input_fill(int timeout_ms) {
+    if (in_head == in_len) in_head = in_len = 0;
+    if (in_len == sizeof(inbuf)) {
+        memmove(inbuf, inbuf + in_head, in_len - in_head);
+        in_len -= in_head;
+        in_head = 0;
+        if (in_len == sizeof(inbuf)) return true;
+    }
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    if (timeout_ms) {
+        STAT_ADD(syscalls, 1);
+        if (poll(&pfd, 1, timeout_ms) <= 0) return false;
+    }
+    ssize_t n = read(STDIN_FILENO, inbuf + in_len, sizeof(inbuf) - in_len);
+    STAT_ADD(syscalls, 1);
+    if (n <= 0) return false;
+    in_len += (size_t)n;
+    return true;
+}
+
+// Next input byte; an empty buffer is refilled without blocking, or within
+// timeout_ms (the grace period for the rest of an escape sequence).
+static bool read_byte(unsigned char *c, int timeout_ms) {
+    if (in_head == in_len && !input_fill(timeout_ms)) return false;
+    *c = inbuf[in_head++];
+    return true;
+}
+
+static int read_key(void) {
+    unsigned char c;
+    if (!read_byte(&c, 0)) return -1;
+    if (c != '\x1b') return c;
+    unsigned char s1; if (!read_byte(&s1, ESC_TIMEOUT_MS)) return '\x1b';
+    if (s1 == 'O') {
+        unsigned char s2; if (!read_byte(&s2, ESC_TIMEOUT_MS)) return '\x1b';
+        switch (s2) {
+            case 'A': return ARROW_UP;
+            case 'B': return ARROW_DOWN;
+            case 'C': return ARROW_RIGHT;
+            case 'D': return ARROW_LEFT;
+            case 'H': return HOME_KEY;
+            case 'F': return END_KEY;
+        }
+        return '\x1b';
+    }
+    if (s1 != '[') return '\x1b';
+
+    // CSI: parameter bytes up to a final byte in 0x40..0x7e; unknown
+    // sequences are consumed whole so none of their bytes leak in as text
+    char params[16];
+    size_t np = 0;
+    unsigned char f;
+    for (;;) {
+        if (!read_byte(&f, ESC_TIMEOUT_MS)) return '\x1b';
+        if (f >= 0x40 && f <= 0x7e) break;
+        if (np < sizeof(params) - 1) params[np++] = (char)f;
+    }
+    params[np] = '\0';
+    switch (f) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+        case '~':
+            if (strcmp(params, "200") == 0) return PASTE_START;
+            if (strcmp(params, "1") == 0 || strcmp(params, "7") == 0) return HOME_KEY;
+            if (strcmp(params, "4") == 0 || strcmp(params, "8") == 0) return END_KEY;
+            if (strcmp(params, "5") == 0) return PAGE_UP;
+            if (strcmp(params, "6") == 0) return PAGE_DOWN;
+            break;
+    }
+    return '\x1b';
+}
+
+/* Bracketed paste: everything up to ESC[201~ is inserted as one block. */
+static char *paste_buf;
+static size_t paste_len, paste_cap;
+
+static void paste_append(const unsigned char *s, size_t n) {
+    if (paste_len + n > paste_cap) {
+        size_t cap = paste_cap ? paste_cap : BUFFER_SIZE;
+        while (cap < paste_len + n) cap *= 2;
+        char *p = realloc(paste_buf, cap);
+        if (!p) die("realloc");
+        paste_buf = p; paste_cap = cap;
+    }
+    memcpy(paste_buf + paste_len, s, n);
+    paste_len += n;
+}
+
+// Collect a bracketed paste into paste_buf.
+static void read_paste(void) {
+    static const char end_marker[] = "\x1b[201~";
+    const size_t mlen = sizeof(end_marker) - 1;
+    paste_len = 0;
+    for (;;) {
+        const unsigned char *p = inbuf + in_head, *end = inbuf + in_len;
+        const unsigned char *esc = p;
+        while ((esc = memchr(esc, '\x1b', (size_t)(end - esc))) != NULL) {
+            if ((size_t)(end - esc) < mlen) break;       // maybe a split marker
+            if (memcmp(esc, end_marker, mlen) == 0) {
+                paste_append(p, (size_t)(esc - p));
+                in_head = (size_t)(esc + mlen - inbuf);
+                return;
+            }
+            esc++;
+        }
+        // keep a possible partial marker in the buffer for the next read
+        size_t keep = esc ? (size_t)(end - esc) : 0;
+        paste_append(p, (size_t)(end - p) - keep);
+        in_head = in_len - keep;
+        if (!input_fill(PASTE_TIMEOUT_MS)) {
+            paste_append(inbuf + in_head, in_len - in_head);   // terminal never ended it
+            in_head = in_len;
+            break;
+        }
+    }
+}
+
+// Decode and handle every key that has arrived, then let the loop redraw once.
+static void process_keypress(void) {
+    input_fill(0);
+    int k;
+    while ((k = read_key()) >= 0) editor_process_key(k);
+}
+
+static void editor_process_key(int k) {
+    STAT_ADD(keys, 1);
+    if (search.active) {
+        if (k == PASTE_START) { read_paste(); search_append(paste_buf, paste_len); }
+        else search_key(k);
+        return;
+    }
+    if (prompt.active) {
+        if (k == PASTE_START) { read_paste(); prompt_append(paste_buf, paste_len); }
+        else prompt_key(k);
+        return;
+    }
+    switch (k) {
+        case '\r': editor_insert_newline(); break;
+        case 17:   /* Ctrl-Q */
+            save_wait();
+            for (int i = 0; i < E.num_buffers; i++) {
+                E.buf = E.buffers[i];
+                journal_close(true);
+            }
+            arena_release();
+            exit(0);                        // atexit() will clean up the TTY
+        case 19:   /* Ctrl-S */ save_file(); break;
+        case 127:  /* Backspace */ editor_delete_char(); break;
+        case ARROW_UP: case ARROW_DOWN: case ARROW_LEFT: case ARROW_RIGHT:
+            editor_move_cursor(k); break;
+        case 6:    /* Ctrl-F */ search_start(); break;
+        case 15:   /* Ctrl-O */ prompt_start("Open", buffer_open); break;
+        case 7:    /* Ctrl-G */ prompt_start("Go to line (or N%)", goto_line); break;
+        case 2:    /* Ctrl-B */ bookmark_toggle(); break;
+        case 11:   /* Ctrl-K */ bookmark_next(); break;
+        case PAGE_UP: case PAGE_DOWN: editor_page(k); break;
+        case HOME_KEY: case END_KEY: editor_home_end(k); break;
+        case 14:   /* Ctrl-N */ buffer_cycle(1); break;
+        case 16:   /* Ctrl-P */ buffer_cycle(-1); break;
+        case 26:   /* Ctrl-Z */ editor_undo(); break;
+        case 25:   /* Ctrl-Y */ editor_redo(); break;
+        case 23:   /* Ctrl-W */
+            E.buf->wrap = !E.buf->wrap;
+            E.buf->wrap_offset = 0;
+            E.buf->col_offset = 0;
+            set_status_message(E.buf->wrap ? "Soft wrap on" : "Soft wrap off");
+            break;
+#if NED_STATS
+        case 20:   /* Ctrl-T */ stats.show = !stats.show; break;
+#endif
+        case PASTE_START: read_paste(); editor_insert_text(paste_buf, paste_len); break;
+        default:
+            if ((k >= 32 && k < 127) || (k >= 128 && k < 256)) editor_insert_char(k);
+            break;
+    }
+}
+
+/* ---------- Benchmark ---------- */
+
+/* ned --bench SIZE... times the hot paths headless on generated text of
+ * each size (suffix K, M or G): opening and indexing, frames across the
+ * file, typing, newlines, backspacing and scrolling (each key followed by
+ * a frame), literal and regex searches to completion (one of them over a
+ * long line full of matches), and saving. Frames
+ * are written to /dev/null; results go to the original stdout. */
+
+struct bench_stat {
+    const char *name;
+    double *ms;
+    size_t n, cap;
+};
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+static void bench_add(struct bench_stat *st, double ms) {
+    if (st->n == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->ms = realloc(st->ms, sizeof(double) * st->cap);
+        if (!st->ms) die("realloc");
+    }
+    st->ms[st->n++] = ms;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_report(FILE *out, const char *size, struct bench_stat *st) {
+    if (!st->n) return;
+    double total = 0;
+    for (size_t i = 0; i < st->n; i++) total += st->ms[i];
+    qsort(st->ms, st->n, sizeof(double), bench_cmp);
+    size_t p99 = st->n * 99 / 100;
+    if (p99 >= st->n) p99 = st->n - 1;
+    fprintf(out, "%-6s %-10s %7zu ops %12.1f ops/s   p50 %10.3f ms   p99 %10.3f ms\n",
+            size, st->name, st->n, total > 0 ? (double)st->n * 1e3 / total : 0,
+            st->ms[st->n / 2], st->ms[p99]);
+    fflush(out);
+    free(st->ms);
+    st->ms = NULL;
+    st->n = st->cap = 0;
+}
+
+// Write `size` bytes of lines made of pseudo-random words (same every run).
+static bool bench_corpus(int fd, size_t size) {
+    static const char *words[] = {
+        "the", "editor", "line", "buffer", "row", "cursor", "screen", "search",
+        "index", "tab\t", "save", "file", "block", "span", "42", "0x1f",
+    };
+    char *buf = malloc(BUFFER_SIZE + 256);
+    if (!buf) die("malloc");
+    uint32_t x = 2463534242u;
+    size_t done = 0, len = 0;
+    int width = 0;
+    while (done + len < size) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        if (width > (int)(x >> 24) / 2) {
+            buf[len++] = '\n';
+            width = 0;
+        } else {
+            const char *w = words[x & 15];
+            size_t n = strlen(w);
+            memcpy(buf + len, w, n);
+            buf[len + n] = ' ';
+            len += n + 1;
+            width += (int)n + 1;
+        }
+        if (len >= BUFFER_SIZE || done + len >= size) {
+            if (done + len > size) len = size - done;
+            if (write(fd, buf, len) != (ssize_t)len) { free(buf); return false; }
+            done += len;
+            len = 0;
+        }
+    }
+    free(buf);
+    return true;
+}
+
+// Forget the current buffer so the next open starts from scratch.
+static void bench_close(void) {
+    journal_close(true);
+    row_table_clear();
+    file_map_forget(E.buf->map);
+    if (E.buf->map) munmap(E.buf->map, E.buf->map_size);
+    E.buf->map = NULL;
+    E.buf->map_size = 0;
+    E.buf->cursor_x = E.buf->cursor_y = E.buf->row_offset = E.buf->col_offset = 0;
+    E.buf->modified = false;
+}
+
+static void bench_wait_index(void) {
+    while (E.buf->index) {
+        struct pollfd pfd = { .fd = E.buf->index->pipe[0], .events = POLLIN };
+        while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {}
+        on_index_pipe(pfd.fd);
+    }
+}
+
+static void bench_wait_search(struct search_job *job) {
+    for (;;) {
+        bool done = true;
+        pthread_mutex_lock(&job->lock);
+        for (int i = 0; i < job->nbuckets; i++) done = done && job->buckets[i].done;
+        pthread_mutex_unlock(&job->lock);
+        if (done) break;
+        struct pollfd pfd = { .fd = search_pipe[0], .events = POLLIN };
+        poll(&pfd, 1, 10);
+        char buf[256];
+        while (read(search_pipe[0], buf, sizeof(buf)) > 0) {}
+    }
+    search_job_cancel(job);
+}
+
+// Time k (and the frame after it) n times, from the middle of the file.
+static void bench_keys(FILE *out, const char *label, const char *name, int k, int n) {
+    struct bench_stat st = { .name = name };
+    E.buf->cursor_y = E.buf->num_rows / 2;
+    E.buf->cursor_x = 0;
+    if (k == 127) for (int i = 0; i < n; i++) editor_process_key('x');
+    for (int i = 0; i < n; i++) {
+        double t = bench_now();
+        editor_process_key(k == 'a' ? 'a' + i % 26 : k);
+        refresh_screen();
+        bench_add(&st, bench_now() - t);
+    }
+    bench_report(out, label, &st);
+}
+
+static void bench_size(FILE *out, const char *label, size_t size) {
+    const char *dir = getenv("TMPDIR");
+    char path[MAX_FILENAME - 8];
+    snprintf(path, sizeof(path), "%s/ned-bench-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd == -1 || !bench_corpus(fd, size)) {
+        fprintf(out, "%-6s corpus: %s\n", label, strerror(errno));
+        if (fd != -1) { close(fd); unlink(path); }
+        return;
+    }
+    close(fd);
+    int reps = size >= (256u << 20) ? 3 : 10;
+
+    struct bench_stat st = { .name = "open" };
+    for (int i = 0; i < reps; i++) {
+        bench_close();
+        double t = bench_now();
+        open_file(path);
+        bench_wait_index();
+        bench_add(&st, bench_now() - t);
+    }
+    bench_report(out, label, &st);
+
+    st.name = "frame";
+    for (int i = 0; i < 500; i++) {
+        E.buf->row_offset = E.buf->cursor_y = (int)((long long)E.buf->num_rows * i / 500);
+        double t = bench_now();
+        refresh_screen();
+        bench_add(&st, bench_now() - t);
+    }
+    bench_report(out, label, &st);
+
+    bench_keys(out, label, "insert", 'a', 2000);
+    bench_keys(out, label, "newline", '\r', 500);
+    bench_keys(out, label, "backspace", 127, 2000);
+    bench_keys(out, label, "scroll", ARROW_DOWN, 2000);
+
+    st.name = "search";
+    for (int i = 0; i < reps; i++) {
+        double t = bench_now();
+        bench_wait_search(search_job_start("zqxj", 4, NULL));
+        bench_add(&st, bench_now() - t);
+    }
+    bench_report(out, label, &st);
+
+    st.name = "regex";
+    for (int i = 0; i < reps; i++) {
+        double t = bench_now();
+        struct regex *re = regex_compile("ro[uvw]+[0-9]", 13);
+        if (re) bench_wait_search(search_job_start(NULL, 0, re));
+        bench_add(&st, bench_now() - t);
+    }
+    bench_report(out, label, &st);
+
+    // a 512K line that is nearly all matches of a prefix-less regex
+    size_t line_len = 512u << 10;
+    char *line = malloc(line_len);
+    if (!line) die("malloc");
+    for (size_t i = 0; i < line_len; i++) line[i] = i % 6 == 5 ? ' ' : (char)('1' + i % 6);
+    editor_insert_row(0, line, line_len);
+    free(line);
+    st.name = "regex-line";
+    for (int i = 0; i < reps; i++) {
+        double t = bench_now();
+        struct regex *re = regex_compile("[0-9]+", 6);
+        if (re) bench_wait_search(search_job_start(NULL, 0, re));
+        bench_add(&st, bench_now() - t);
+    }
+    bench_report(out, label, &st);
+    editor_delete_row(0);
+
+    snprintf(E.buf->filename, sizeof(E.buf->filename), "%s.out", path);
+    st.name = "save";
+    for (int i = 0; i < (reps + 1) / 2; i++) {
+        double t = bench_now();
+        save_file();
+        save_wait();
+        bench_add(&st, bench_now() - t);
+    }
+    bench_report(out, label, &st);
+
+    bench_close();
+    unlink(E.buf->filename);
+    unlink(path);
+}
+
+static int bench_main(int argc, char **argv) {
+    // frames go to /dev/null, the report to the real stdout
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    int null = open("/dev/null", O_WRONLY);
+    if (!out || null == -1 || dup2(null, STDOUT_FILENO) == -1) { perror("--bench"); return 1; }
+    close(null);
+    tcgetattr(STDIN_FILENO, &E.orig_termios);   // for die(); harmless off a tty
+    newline_scan_init();
+    init_editor();
+
+    static char *defaults[] = { "1M" };
+    if (argc == 0) { argc = 1; argv = defaults; }
+    for (int i = 0; i < argc; i++) {
+        char *end;
+        unsigned long long n = strtoull(argv[i], &end, 10);
+        if (*end == 'K' || *end == 'k') n <<= 10;
+        else if (*end == 'M' || *end == 'm') n <<= 20;
+        else if (*end == 'G' || *end == 'g') n <<= 30;
+        if (n == 0) { fprintf(out, "bad size: %s\n", argv[i]); continue; }
+        bench_size(out, argv[i], (size_t)n);
+    }
+    fclose(out);
+    return 0;
+}
+
+/* ---------- Init / Main ---------- */
+
+static void init_editor(void) {
+    E.buf = buffer_new();
+    E.status_msg[0] = '\0';
+    if (get_window_size(&E.screen_rows, &E.screen_cols) == -1) {
+        E.screen_rows = SCREEN_ROWS; E.screen_cols = SCREEN_COLS;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) return bench_main(argc - 2, argv + 2);
+
+    const char **paths = malloc(sizeof(*paths) * (size_t)argc);
+    if (!paths) die("malloc");
+    int num_paths = 0;
+    bool follow_mode = false, dump_stats = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "--follow") == 0) follow_mode = true;
+        else if (strcmp(argv[i], "--stats") == 0) dump_stats = true;
+        else paths[num_paths++] = argv[i];
+    }
+#if NED_STATS
+    if (dump_stats) atexit(stats_dump);     // registered first, so it runs after the TTY is restored
+#else
+    if (dump_stats) fprintf(stderr, "ned: --stats needs a build with NED_STATS\n");
+#endif
+
+    // `ned -` reads the text from stdin, so keys come from the terminal
+    int input = -1;
+    for (int i = 0; i < num_paths && input == -1; i++) {
+        if (strcmp(paths[i], "-") != 0) continue;
+        input = dup(STDIN_FILENO);
+        int tty = open("/dev/tty", O_RDWR);
+        if (input == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+            perror("/dev/tty");
+            return 1;
+        }
+        close(tty);
+    }
+
+    enable_raw_mode();
+    newline_scan_init();
+    init_editor();
+    event_init();
+
+    // one buffer per file; the first one is shown
+    for (int i = 0; i < num_paths; i++) {
+        if (i > 0) E.buf = buffer_new();
+        E.buf->read_only = follow_mode;
+        const char *path = paths[i];
+        if (input != -1 && strcmp(path, "-") == 0) {
+            if (stream_start(input)) set_status_message("Reading from stdin");
+            input = -1;
+            path = NULL;
+        } else {
+            open_file(path);
+        }
+        if (follow_mode) follow_start(path);
+    }
+    free(paths);
+    E.buf = E.buffers[0];
+    if (num_paths == 0) E.buf->read_only = follow_mode;
+    if (num_paths == 0 && follow_mode) follow_start(NULL);
+    else if (num_paths == 0) set_status_message("Help: Ctrl+S=Save | Ctrl+Q=Quit | Ctrl+F=Find | Ctrl+Z=Undo | Ctrl+Y=Redo");
+
+    for (;;) {
+        if (ned_redraw) {
+            ned_redraw = false;
+            refresh_screen();
+        }
+        event_wait();
     }
     return 0;
 }